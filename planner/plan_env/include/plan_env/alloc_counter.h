@@ -0,0 +1,20 @@
+#ifndef ALLOC_COUNTER_H_
+#define ALLOC_COUNTER_H_
+
+#include <cstdint>
+
+/* Opt-in count of heap allocations per thread, to check that the fusion
+ * stages stop allocating once warmed up. Only a build with
+ * PLAN_ENV_COUNT_ALLOCS replaces the global operator new; otherwise nothing
+ * is counted. Memory that OpenCV or Eigen take from malloc directly is not
+ * seen either way. */
+namespace alloc_counter {
+
+bool enabled();
+
+// allocations made by the calling thread so far
+uint64_t threadAllocations();
+
+}  // namespace alloc_counter
+
+#endif  // ALLOC_COUNTER_H_
@@ -0,0 +1,14 @@
+#ifndef DEPTH_POOL_H_
+#define DEPTH_POOL_H_
+
+#include <opencv2/core/core.hpp>
+
+// Downsample a 16UC1 depth image by keeping the closest valid depth of every
+// factor x factor block, so thin structures survive the reduction. Depths
+// from 1 to below min_valid are too close to trust and only win a block
+// without a valid one; zero pixels carry no return and only win when the
+// whole block is empty. The margin is cropped from all four borders before
+// pooling.
+void minPoolDepth(const cv::Mat& src, int margin, int factor, int min_valid, cv::Mat& dst);
+
+#endif  // DEPTH_POOL_H_
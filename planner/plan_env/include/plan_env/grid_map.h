@@ -3,13 +3,19 @@
 
 #include <Eigen/Eigen>
 #include <Eigen/StdVector>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cv_bridge/cv_bridge.h>
 #include <geometry_msgs/PoseStamped.h>
 #include <iostream>
+#include <mutex>
 #include <random>
 #include <nav_msgs/Odometry.h>
 #include <queue>
 #include <ros/ros.h>
+#include <sensor_msgs/CompressedImage.h>
+#include <thread>
 #include <tuple>
 #include <visualization_msgs/Marker.h>
 
@@ -22,12 +28,29 @@
 #include <message_filters/sync_policies/exact_time.h>
 #include <message_filters/time_synchronizer.h>
 
+#include <plan_env/MapChunk.h>
+#include <plan_env/MapDelta.h>
+#include <plan_env/alloc_counter.h>
+#include <plan_env/depth_pool.h>
+#include <plan_env/map_codec.h>
+#include <plan_env/object_pool.h>
+#include <plan_env/pose_buffer.h>
 #include <plan_env/raycast.h>
+#include <plan_env/spsc_ring.h>
+#include <plan_env/stage_queue.h>
+#include <plan_env/voxel_hash.h>
 
 #define logit(x) (log((x) / (1 - (x))))
 
 using namespace std;
 
+// from plan_env/obj_predictor.h, only grid_map.cpp needs the definitions
+namespace fast_planner {
+class PolynomialPrediction;
+typedef shared_ptr<vector<PolynomialPrediction>> ObjPrediction;
+typedef shared_ptr<vector<Eigen::Vector3d>> ObjScale;
+}  // namespace fast_planner
+
 // voxel hashing
 template <typename T>
 struct matrix_hash : std::unary_function<T, size_t> {
@@ -54,6 +77,11 @@ struct MappingParameters {
   double obstacles_inflation_;
   string frame_id_;
   int pose_type_;
+  bool interpolate_odom_;      // camera pose interpolated from buffered odometry at the image stamp
+  bool compressed_depth_;      // subscribe to compressedDepth (rvl or png) instead of raw images
+  bool cloud_fusion_;          // raycast world-frame clouds from the odometry origin into the log-odds map
+  double odom_sync_tolerance_;  // images newer than the latest odometry by at most this take its pose
+  double odom_wait_max_;        // seconds to wait for odometry that is further behind an image
 
   /* camera parameters */
   double cx_, cy_, fx_, fy_;
@@ -67,48 +95,247 @@ struct MappingParameters {
   bool use_depth_filter_;
   double k_depth_scaling_factor_;
   int skip_pixel_;
+  bool use_min_pool_;  // min-pool skip_pixel_ blocks instead of striding
+  int pool_min_raw_;   // raw depths below this only win a block with no valid one
+
+  /* organised LiDAR scans, binned into a range image by beam */
+  int lidar_vtc_line_num_, lidar_hrz_line_num_;  // no vertical lines: clouds stay unordered
+  double lidar_vtc_range_, lidar_hrz_range_;     // field of view in rad, centred on the body x axis
+  int lidar_pool_;                               // beams min-pooled per block side
+  int lidar_skip_scans_;                         // scans dropped after each fused one
+  bool lidar_no_return_free_;                    // beams without return clear up to max_ray_length_
+
+  /* tracked objects, kept out of the static map */
+  bool mask_dynamic_objects_;  // needs setObjPrediction; projective fusion ignores it
+  double dynamic_obj_margin_;  // grown on every side of the object scale
+  bool dynamic_obj_as_miss_;   // trace endpoints inside an object as misses instead of dropping them
 
   /* raycasting */
   double p_hit_, p_miss_, p_min_, p_max_, p_occ_;  // occupancy probability
   double prob_hit_log_, prob_miss_log_, clamp_min_log_, clamp_max_log_,
       min_occupancy_log_;                   // logit of occupancy probability
   double min_ray_length_, max_ray_length_;  // range of doing raycasting
+  bool use_ray_packet_;                     // trace rays in SIMD packets
+  int fusion_threads_;                      // raycasting threads, 0 for all cores
+  bool use_projective_fusion_;              // project voxels into the image instead of tracing rays
+  bool sort_rays_;                          // trace rays grouped by direction
+  vector<double> coarse_ranges_;            // beyond the k-th range, free space is traced in 2^k blocks
+  bool pipeline_fusion_;                    // projection, raycasting and inflation on their own threads
+  int max_coalesced_frames_;                // pending frames fused in one batch
+  vector<int> mapping_cpus_;                // cores of the mapping thread, empty to leave it unpinned
+  int alloc_warmup_cycles_;                 // with the allocation counter built in, cycles before
+  bool abort_on_alloc_;                     // a fusion stage must stop allocating, or abort
+  bool velocity_priority_;                  // fuse and publish rays along the velocity before the rest
+  double priority_cone_;                    // half angle of the forward cone, rad
+  double priority_min_speed_;               // slower than this, all rays go in one pass
+  double velocity_window_;                  // odometry span the velocity is taken over
+  double map_delta_keyframe_interval_;      // seconds between full maps among the deltas
+  double map_stream_keyframe_interval_;     // the same for the compressed map stream
+  int map_stream_compression_;              // zlib level of the stream, 1 fastest to 9 smallest
 
   /* local map update and clear */
   int local_map_margin_;
 
   /* visualization and computation time display */
   double visualization_truncate_height_, virtual_ceil_height_, ground_height_, virtual_ceil_yp_, virtual_ceil_yn_;
+  double visualization_rate_;  // Hz of the visualization thread, 0 to not start it
+  int visualization_threads_;  // threads scanning the map for the published clouds
   bool show_occ_time_;
 
   /* active mapping */
   double unknown_flag_;
 };
 
+// one depth frame on its way through the fusion stages
+
+struct DepthFrame {
+  DepthFrame() : range_image_(false), proj_points_cnt_(0), seq_(0), pose_pending_(false) {
+  }
+
+  // the message as received, decoded into depth_ on the mapping thread
+  sensor_msgs::ImageConstPtr image_;
+  sensor_msgs::CompressedImageConstPtr compressed_;
+  // or a world-frame cloud, traced from the body origin; with a beam layout
+  // the projection stage bins it into depth_ as a range image
+  sensor_msgs::PointCloud2ConstPtr cloud_;
+  bool range_image_;
+  cv::Mat depth_;
+  Eigen::Vector3d camera_pos_;
+  Eigen::Matrix3d camera_r_m_;
+  ros::Time stamp_;
+  // world points, filled by the projection stage
+  vector<Eigen::Vector3d> proj_points_;
+  int proj_points_cnt_;
+  // position in the frame ring
+  uint64_t seq_;
+  // camera pose still to be interpolated from odometry, with the extrinsic
+  // at the time the image arrived, and until when to wait for odometry
+  bool pose_pending_;
+  Eigen::Matrix3d cam2body_r_;
+  Eigen::Vector3d cam2body_t_;
+  std::chrono::steady_clock::time_point pose_deadline_;
+};
+// frames come from and go back to the GridMap's frame pool
+typedef ObjectPool<DepthFrame>::Ptr DepthFramePtr;
+
+// occupied voxels of an updated local box, handed from raycasting to
+// inflation so that inflation never reads occupancy_buffer_, and the state
+// of every voxel of the box grown by what clearLocalMap() resets around it,
+// x major like the map, for the published versions
+
+struct InflateJob {
+  Eigen::Vector3i bound_min_, bound_max_;
+  vector<int> occupied_;
+  Eigen::Vector3i state_min_, state_max_;
+  vector<char> state_;
+};
+typedef ObjectPool<InflateJob>::Ptr InflateJobPtr;
+
+// one traced ray per distinct endpoint voxel, with the rays that ended there
+
+struct RayEnd {
+  int adr;
+  Eigen::Vector3i id, start_id;
+  int hit, miss;
+  // unit direction and the clipped range of the traced ray
+  Eigen::Vector3d dir;
+  double near, far;
+};
+
+// one published copy of occupancy_buffer_inflate_ and occupancy_state_,
+// with the local box it was updated for; readers count themselves in, and
+// the writer only recycles a copy that is neither current nor read
+
+struct InflateVersion {
+  vector<char> buffer_;
+  vector<char> state_;
+  Eigen::Vector3i bound_min_, bound_max_;
+  uint64_t version_;
+  std::atomic<int> readers_;
+  const void* owner_;
+};
+
+// per-thread scratch of the parallel raycasting
+
+struct RaycastWorker {
+  // rays of one block stop at voxels already traversed within the block
+  VoxelHashSet traversed_, coarse_traversed_;
+  // missed voxels as (address << 3 | frame of the batch), by address slab;
+  // 64 bits, as the shifted address of a large map does not fit an int
+  vector<vector<uint64_t>> slab_log_;
+  // missed coarse blocks as (coarse address << 3 | level)
+  vector<int> coarse_log_;
+  // camera depth, pixel and range of the voxels of one map column, for
+  // projective fusion
+  vector<double> column_z_, column_u_, column_v_, column_range_;
+};
+
 // intermediate mapping data for fusion
+//
+// Each field has one owning thread, the only one that touches it unless
+// noted: the spinner runs the callbacks, the projection stage decodes and
+// projects frames, the raycast stage fuses them into occupancy_buffer_ and
+// the inflation stage publishes versions. Without pipeline_fusion all three
+// stages are the mapping thread. Other threads only read published versions.
 
 struct MappingData {
-  // main map data, occupancy of each voxel and Euclidean distance
+  // main map data, occupancy of each voxel and Euclidean distance; log-odds
+  // are the raycast stage's, inflation and the unknown, free or occupied
+  // state copied from its jobs are written under inflate_mutex_, by the
+  // inflation stage, resets and the cloud map
 
   std::vector<double> occupancy_buffer_;
   std::vector<char> occupancy_buffer_inflate_;
-
-  // camera position and pose data
+  std::vector<char> occupancy_state_;
+
+  // published versions of the inflated map and the box each recent
+  // version changed, so a recycled copy only catches up on those boxes
+
+  vector<std::unique_ptr<InflateVersion>> inflate_versions_;
+  std::atomic<InflateVersion*> inflate_current_;
+  uint64_t inflate_version_;
+  vector<std::pair<Eigen::Vector3i, Eigen::Vector3i>> inflate_dirty_;
+
+  // map deltas: the inflated map as last sent, the box changed since and
+  // the version it was last grown for, and the voxels that changed in the
+  // last update of the sent map; for the delta messages and the compressed
+  // stream, the version of the last message, the subscribers it went to,
+  // whether a keyframe went out yet and when; the visualization thread's,
+  // but for the box and its version under delta_mutex_
+
+  vector<char> delta_state_;
+  Eigen::Vector3i delta_dirty_min_, delta_dirty_max_;
+  uint64_t delta_dirty_version_;
+  vector<int> delta_added_, delta_removed_;
+  uint64_t delta_version_, stream_version_;
+  int delta_subs_, stream_subs_;
+  bool delta_synced_, stream_synced_;
+  ros::Time delta_keyframe_time_, stream_keyframe_time_;
+
+  // compressed stream: bricks of the next chunk, flags against listing one
+  // twice, and the bytes sent since the first chunk
+
+  map_codec::MapChunkEncoder stream_encoder_;
+  vector<int> stream_bricks_;
+  vector<char> stream_brick_listed_;
+  size_t stream_bytes_;
+  ros::Time stream_start_time_;
+
+  // version and subscriber count of the last full clouds, to skip
+  // republishing an unchanged map; the visualization thread's
+
+  uint64_t map_pub_version_, map_inf_pub_version_;
+  int map_pub_subs_, map_inf_pub_subs_;
+
+  // cloud map: sorted occupied addresses of the last scan, in the map grown
+  // by the inflation reach, and how many of them inflate each voxel, diffed
+  // scan to scan through an address stencil; written under inflate_mutex_
+
+  vector<int> cloud_occ_, cloud_occ_next_;
+  vector<uint16_t> cloud_inflate_refs_;
+  vector<int> inflate_stencil_;
+  vector<Eigen::Vector3i> inflate_stencil_id_;
+
+  // camera pose of the frame being fused, the raycast stage's, and of the
+  // last projected frame, the projection stage's; the latest odometry
+  // position is the spinner's, the cloud map is built around it
 
   Eigen::Vector3d camera_pos_, last_camera_pos_;
   Eigen::Matrix3d camera_r_m_, last_camera_r_m_;
+  Eigen::Vector3d odom_pos_;
   Eigen::Matrix4d cam2body_;
 
-  // depth image data
+  // depth image data, the projection stage's
 
-  cv::Mat depth_image_, last_depth_image_;
+  cv::Mat last_depth_image_;
+  cv::Mat depth_pool_;  // closest depth of each skip_pixel_ block
   int image_cnt_;
 
-  // flags of map state
+  // inflation offsets of a voxel, reused by every inflation
+  vector<Eigen::Vector3i> inf_pts_;
+
+  // LiDAR range image layout: first beam angles and spacing, and the unit
+  // direction (sensor frame) of every block of the pooled image
+
+  int range_rows_, range_cols_;
+  double range_az0_, range_el0_, range_hrz_res_, range_vtc_res_;
+  bool range_wrap_;
+  cv::Mat range_pool_;
+  vector<Eigen::Vector3d> beam_dir_;
+  int lidar_scan_cnt_;
+
+  // predicted object boxes at the stamp of the frame being fused, and
+  // their union for a quick reject
 
-  bool occ_need_update_, local_updated_;
-  bool has_first_depth_;
-  bool has_odom_, has_cloud_;
+  vector<Eigen::Vector3d> obj_box_min_, obj_box_max_;
+  Eigen::Vector3d obj_bound_min_, obj_bound_max_;
+
+  // flags of map state; local_updated_ is the raycast stage's, the others
+  // are set by the stages or callbacks and read from any thread
+
+  bool local_updated_;
+  std::atomic<bool> has_first_depth_;
+  std::atomic<bool> has_odom_, has_cloud_;
 
   // odom_depth_timeout_
   ros::Time last_occ_update_time_;
@@ -120,21 +347,44 @@ struct MappingData {
   vector<Eigen::Vector3d> proj_points_;
   int proj_points_cnt;
 
-  // flag buffers for speeding up raycasting
+  // direction bin of every ray and the bucket offsets of the ray sort
+  vector<Eigen::Vector3d> proj_points_sorted_;
+  vector<int> ray_bin_, ray_bin_start_;
+
+  // voxel-aligned box that rays are clipped to, see localUpdateBox()
+  Eigen::Vector3d ray_clip_min_, ray_clip_max_;
+  Eigen::Vector3i ray_clip_min_id_, ray_clip_max_id_;
+
+  // distinct endpoint voxels of the frame, indexed by address
+  vector<RayEnd> ray_ends_;
+  VoxelHashMap<int> ray_end_map_;
+
+  // coarse grid size of every level and the blocks missed this frame
+  vector<Eigen::Vector3i> coarse_voxel_num_;
+  vector<int> coarse_blocks_;
+
+  // hits minus misses of every frame of the batch, max_coalesced_frames_
+  // counters per voxel; each address slab keeps the voxels it touched, so
+  // slabs are merged and updated in parallel
 
-  vector<short> count_hit_, count_hit_and_miss_;
-  vector<char> flag_traverse_, flag_rayend_;
-  char raycast_num_;
-  queue<Eigen::Vector3i> cache_voxel_;
+  vector<short> count_votes_;
+  vector<uint8_t> count_frames_;  // frames of the batch that observed a voxel
+  int batch_frame_;
+  vector<vector<int>> slab_voxel_;
+  int slab_shift_;
+  vector<RaycastWorker> raycast_workers_;
 
-  // range of updating grid
+  // range of updating grid, the raycast stage's; readers take the box of a
+  // published version; and the most occupied voxels a job has held
 
   Eigen::Vector3i local_bound_min_, local_bound_max_;
+  size_t occupied_max_;
 
-  // computation time
+  // computation time, and allocations of warmed-up stages, see alloc_counter.h
 
   double fuse_time_, max_fuse_time_;
   int update_num_;
+  std::atomic<uint64_t> warm_allocs_;
 
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
@@ -142,9 +392,44 @@ struct MappingData {
 class GridMap {
 public:
   GridMap() {}
-  ~GridMap() {}
+  ~GridMap();
 
   enum { POSE_STAMPED = 1, ODOMETRY = 2, INVALID_IDX = -10000 };
+  enum { RAYCAST_BLOCK = 256, RAYCAST_SLABS = 64 };
+  enum { COARSE_MAX_LEVEL = 7, MAX_COALESCED_FRAMES = 8 };
+  enum { INFLATE_VERSIONS = 3, INFLATE_HISTORY = 16 };
+  enum { VOXEL_UNKNOWN = 0, VOXEL_FREE = 1, VOXEL_OCCUPIED = 2 };
+  // ring around the local box that clearLocalMap() resets to unknown
+  enum { LOCAL_CLEAR_MARGIN = 5 };
+
+  /* Holds one published version of the map for the calling thread. Until
+   * the pin is destroyed, getOccupancy, getInflateOccupancy, isUnknown,
+   * isKnownFree and isKnownOccupied on that thread read this version, while
+   * fusion keeps publishing newer ones. An unpinned query pins the latest
+   * version for itself alone, so successive queries may see different
+   * versions and each pays two atomic operations; pin once per planning
+   * cycle to avoid both. */
+  class VersionPin {
+  public:
+    VersionPin() : version_(nullptr), previous_(nullptr) {
+    }
+    VersionPin(VersionPin&& other) : version_(other.version_), previous_(other.previous_) {
+      other.version_ = nullptr;
+    }
+    VersionPin(const VersionPin&) = delete;
+    VersionPin& operator=(const VersionPin&) = delete;
+    ~VersionPin();
+
+    uint64_t version() const {
+      return version_ ? version_->version_ : 0;
+    }
+
+  private:
+    friend class GridMap;
+    InflateVersion* version_;
+    InflateVersion* previous_;
+  };
+  enum { RAY_SORT_CELLS = 32, RAY_SORT_BINS = 6 * RAY_SORT_CELLS * RAY_SORT_CELLS };
 
   // occupancy map management
   void resetBuffer();
@@ -154,11 +439,15 @@ public:
   inline void indexToPos(const Eigen::Vector3i& id, Eigen::Vector3d& pos);
   inline int toAddress(const Eigen::Vector3i& id);
   inline int toAddress(int& x, int& y, int& z);
+  inline void addressToIndex(int adr, Eigen::Vector3i& id);
   inline bool isInMap(const Eigen::Vector3d& pos);
   inline bool isInMap(const Eigen::Vector3i& idx);
 
-  inline void setOccupancy(Eigen::Vector3d pos, double occ = 1);
-  inline void setOccupied(Eigen::Vector3d pos);
+  // write one voxel and publish a version with it; setOccupancy writes the
+  // log-odds of the fused map and only while no frames are fused, a voxel
+  // setOccupied inflates stays until fusion inflates around it again
+  void setOccupancy(Eigen::Vector3d pos, double occ = 1);
+  void setOccupied(Eigen::Vector3d pos);
   inline int getOccupancy(Eigen::Vector3d pos);
   inline int getOccupancy(Eigen::Vector3i id);
   inline int getInflateOccupancy(Eigen::Vector3d pos);
@@ -169,10 +458,20 @@ public:
   inline bool isKnownFree(const Eigen::Vector3i& id);
   inline bool isKnownOccupied(const Eigen::Vector3i& id);
 
+  // pin the latest version of the inflated map, e.g. for one planning cycle
+  VersionPin pinVersion();
+
+  // latest output of an ObjPredictor, copied for the mapping thread
+  void setObjPrediction(fast_planner::ObjPrediction prediction, fast_planner::ObjScale scale);
+
   void initMap(ros::NodeHandle& nh);
 
   void publishMap();
   void publishMapInflate(bool all_info = false);
+  // what changed in the inflated map since the last call, or all of it, as
+  // delta messages and as compressed chunks; called by the visualization
+  // thread, only one thread may call it
+  void publishMapDelta();
 
   void publishDepth();
 
@@ -183,6 +482,15 @@ public:
   Eigen::Vector3d getOrigin();
   int getVoxelNum();
   bool getOdomDepthTimeout() { return md_.flag_depth_odom_timeout_; }
+  // heap allocations the fusion stages made after alloc_warmup_cycles_,
+  // counted only in a PLAN_ENV_COUNT_ALLOCS build
+  uint64_t getWarmAllocations() { return md_.warm_allocs_; }
+  // mean and longest fusion of a frame batch so far, in seconds; read once
+  // fusion is idle, the fusion thread writes them unlocked
+  void getFusionTime(double& mean, double& max) {
+    mean = md_.update_num_ > 0 ? md_.fuse_time_ / md_.update_num_ : 0.0;
+    max = md_.max_fuse_time_;
+  }
 
   typedef std::shared_ptr<GridMap> Ptr;
 
@@ -197,21 +505,113 @@ private:
                          const geometry_msgs::PoseStampedConstPtr& pose);
   void extrinsicCallback(const nav_msgs::OdometryConstPtr& odom);
   void depthOdomCallback(const sensor_msgs::ImageConstPtr& img, const nav_msgs::OdometryConstPtr& odom);
+  void depthCallback(const sensor_msgs::ImageConstPtr& img);
+  void depthCompressedCallback(const sensor_msgs::CompressedImageConstPtr& img);
+  void submitPosePendingFrame(DepthFramePtr frame);
   void cloudCallback(const sensor_msgs::PointCloud2ConstPtr& img);
   void odomCallback(const nav_msgs::OdometryConstPtr& odom);
 
-  // update occupancy by raycasting
-  void updateOccupancyCallback(const ros::TimerEvent& /*event*/);
-  void visCallback(const ros::TimerEvent& /*event*/);
+  // a cleared frame from the pool, and handing it to the mapping thread;
+  // frame_ring_ takes a single producer, so the frame callbacks must not
+  // run at the same time, as under ros::spin() or any spinner with one
+  // thread on the node's callback queue
+  DepthFramePtr acquireFrame();
+  void submitFrame(DepthFramePtr frame);
+  void fusionWatchdogCallback(const ros::TimerEvent& /*event*/);
+
+  // publishes the map at the lowest priority, off the callback and mapping threads
+  void visualizationLoop();
+  void stopVisualization();
+  // send the last update of the sent map to one kind of subscriber
+  void publishDeltaMsg(uint64_t version, const ros::Time& now);
+  void publishMapChunk(uint64_t version, const ros::Time& now);
+  // voxels of the box below the truncation height, written straight into
+  // msg; occupied reads a pinned version
+  template <typename Occupied>
+  void fillVoxelCloud(Eigen::Vector3i min_cut, Eigen::Vector3i max_cut, Occupied occupied,
+                      sensor_msgs::PointCloud2& msg);
 
   // main update process
-  void projectDepthImage();
+  bool decodeDepth(DepthFrame& frame);
+  void projectFrame(DepthFrame& frame);
+  void projectCloud(DepthFrame& frame);
+  void initRangeImage();
+  void buildRangeImage(DepthFrame& frame);
+  void projectRangeImage(DepthFrame& frame);
+  void projectiveRangeProcess(const DepthFrame& frame);
+  inline bool rangeImageCell(const Eigen::Vector3d& pt, double range, int& row, int& col);
+  inline void updateProjectiveVoxel(double& occ, bool hit);
+  void updateObjBoxes(const ros::Time& stamp);
+  inline bool inObjBox(const Eigen::Vector3d& pt);
+  bool decodeCompressedDepth(const sensor_msgs::CompressedImage& img, cv::Mat& depth);
+  void projectDepthImage(DepthFrame& frame);
+  void projectPooledDepth(DepthFrame& frame);
   void raycastProcess();
-  void clearAndInflateLocalMap();
+  void updateOccupancyCounts();
+  void mergeRayCounts();
+  void mergeSlabLogs(int s);
+  inline double countedOccupancy(int adr);
+  void expandLocalBound(const Eigen::Vector3i& min_id, const Eigen::Vector3i& max_id);
+  void sortRaysByDirection();
+  void collectRayEnds(const Eigen::Vector3i& cam_id);
+  void raycastBlock(int begin, int end, RaycastWorker& worker);
+  void fillCoarseBlocks();
+  inline int coarseLevel(double range);
+  void projectiveProcess(const DepthFrame& frame);
+  void clearLocalMap();
+  // counted: as if the pending hit and miss counts were applied
+  void collectOccupied(InflateJob& job, bool counted = false);
+  void inflateLocalMap(const InflateJob& job);
+  void clearInflation(const Eigen::Vector3i& min_id, const Eigen::Vector3i& max_id);
+  void initInflateStencil();
+  // cloud map voxels may lie up to the inflation reach outside the map
+  inline int cloudAddress(const Eigen::Vector3i& id);
+  inline void cloudIndex(int adr, Eigen::Vector3i& id);
+  inline bool isInCloudGrid(const Eigen::Vector3i& id);
+  void inflateCloudVoxel(int adr, int delta);
+
+  // copy the changed box of occupancy_buffer_inflate_ and occupancy_state_
+  // into a free version and make it current, for the local box bound_min_
+  // to bound_max_; with inflate_mutex_ held
+  void publishInflateVersion(Eigen::Vector3i min_id, Eigen::Vector3i max_id, const Eigen::Vector3i& bound_min,
+                             const Eigen::Vector3i& bound_max);
+  void copyInflateBox(InflateVersion& dst, const Eigen::Vector3i& min_id, const Eigen::Vector3i& max_id);
+  // publish a version with one voxel changed; with inflate_mutex_ held
+  void publishInflateVoxel(const Eigen::Vector3i& id);
+  // the pinned version of the calling thread, or else the current one, which
+  // only stays valid under a pin
+  inline const InflateVersion* readVersion();
+  // a pin for a single query, empty if the thread already pins this map
+  inline VersionPin queryPin();
+  inline const char* inflateBuffer();
+  static thread_local InflateVersion* pinned_inflate_;
+
+  // raycast stage: fuse projected frames, true if job holds an update
+  bool fuseFrames(vector<DepthFramePtr>& frames, InflateJob& job);
+  bool fusePriorityRays(vector<DepthFramePtr>& frames, InflateJob& job);
+  bool odomVelocity(double stamp, Eigen::Vector3d& vel);
+
+  // fusion threads: one for all steps, or a pipeline of stage threads, each
+  // feeding the next one
+  void startFusionThreads();
+  void stopFusionThreads();
+  void pinMappingThread();
+  bool popFrames(vector<DepthFramePtr>& frames);
+  enum PoseStatus { POSE_OK, POSE_WAIT, POSE_DROP };
+  PoseStatus resolveFramePose(DepthFrame& frame);
+  void fusionStage();
+  void projectStage();
+  void raycastStage();
+  void inflateStage();
+  void checkAllocations(const char* stage, int& cycles, uint64_t& allocs);
 
   inline void inflatePoint(const Eigen::Vector3i& pt, int step, vector<Eigen::Vector3i>& pts);
-  int setCacheOccupancy(Eigen::Vector3d pos, int occ);
-  Eigen::Vector3d closetPointInMap(const Eigen::Vector3d& pt, const Eigen::Vector3d& camera_pt);
+
+  // voxels a frame may update: local update range, map and virtual ceiling
+  void localUpdateBox(Eigen::Vector3i& min_id, Eigen::Vector3i& max_id);
+  // clip camera_pos_ + t * ray, t in [t_in, t_out], to the ray clip box
+  bool clipRay(const Eigen::Vector3d& ray, double& t_in, double& t_out);
+  inline bool isInClipBox(const Eigen::Vector3i& id);
 
   // typedef message_filters::sync_policies::ExactTime<sensor_msgs::Image,
   // nav_msgs::Odometry> SyncPolicyImageOdom; typedef
@@ -231,9 +631,41 @@ private:
   SynchronizerImagePose sync_image_pose_;
   SynchronizerImageOdom sync_image_odom_;
 
+  ros::Subscriber depth_compressed_sub_;
   ros::Subscriber indep_cloud_sub_, indep_odom_sub_, extrinsic_sub_;
-  ros::Publisher map_pub_, map_inf_pub_;
-  ros::Timer occ_timer_, vis_timer_;
+  ros::Publisher map_pub_, map_inf_pub_, map_delta_pub_, map_stream_pub_;
+  ros::Timer occ_timer_;
+
+  // frames and inflation jobs are recycled, they outlive the queues below
+  ObjectPool<DepthFrame> frame_pool_;
+  ObjectPool<InflateJob> job_pool_;
+  // callbacks -> mapping thread, which projects or runs all steps; set
+  // while a callback pushes, to catch a second one pushing at the same time
+  SpscRing<DepthFrame, ObjectPool<DepthFrame>::Recycler> frame_ring_;
+  std::atomic<bool> frame_pushing_;
+  // frames the mapping thread took from the ring but holds back, oldest
+  // first, until odometry reaches the first one; at most max_coalesced_frames_
+  vector<DepthFramePtr> pose_waiting_;
+  // body poses from grid_map/odom, for interpolated camera and LiDAR poses
+  PoseBuffer odom_buffer_;
+  // copies of the object predictions from setObjPrediction, null until the
+  // first one
+  std::mutex obj_mutex_;
+  fast_planner::ObjPrediction obj_predictions_;
+  vector<Eigen::Vector3d> obj_scales_;
+  // serialises the writers of the inflated map and its versions: the
+  // inflation stage, resetBuffer and the cloud map; taken before delta_mutex_
+  std::mutex inflate_mutex_;
+  // guards the delta box, grown by the mapping thread
+  std::mutex delta_mutex_;
+  StageQueue<DepthFramePtr> raycast_queue_;
+  StageQueue<InflateJobPtr> inflate_queue_;
+  std::thread mapping_thread_, raycast_thread_, inflate_thread_;
+  // the visualization thread sleeps on vis_cv_ between publications
+  std::thread vis_thread_;
+  std::mutex vis_mutex_;
+  std::condition_variable vis_cv_;
+  bool vis_stop_;
 
   //
   uniform_real_distribution<double> rand_noise_;
@@ -252,6 +684,13 @@ inline int GridMap::toAddress(int& x, int& y, int& z) {
   return x * mp_.map_voxel_num_(1) * mp_.map_voxel_num_(2) + y * mp_.map_voxel_num_(2) + z;
 }
 
+inline void GridMap::addressToIndex(int adr, Eigen::Vector3i& id) {
+  id(2) = adr % mp_.map_voxel_num_(2);
+  adr /= mp_.map_voxel_num_(2);
+  id(1) = adr % mp_.map_voxel_num_(1);
+  id(0) = adr / mp_.map_voxel_num_(1);
+}
+
 inline void GridMap::boundIndex(Eigen::Vector3i& id) {
   Eigen::Vector3i id1;
   id1(0) = max(min(id(0), mp_.map_voxel_num_(0) - 1), 0);
@@ -263,7 +702,8 @@ inline void GridMap::boundIndex(Eigen::Vector3i& id) {
 inline bool GridMap::isUnknown(const Eigen::Vector3i& id) {
   Eigen::Vector3i id1 = id;
   boundIndex(id1);
-  return md_.occupancy_buffer_[toAddress(id1)] < mp_.clamp_min_log_ - 1e-3;
+  VersionPin pin = queryPin();
+  return readVersion()->state_[toAddress(id1)] == VOXEL_UNKNOWN;
 }
 
 inline bool GridMap::isUnknown(const Eigen::Vector3d& pos) {
@@ -279,7 +719,9 @@ inline bool GridMap::isKnownFree(const Eigen::Vector3i& id) {
 
   // return md_.occupancy_buffer_[adr] >= mp_.clamp_min_log_ &&
   //     md_.occupancy_buffer_[adr] < mp_.min_occupancy_log_;
-  return md_.occupancy_buffer_[adr] >= mp_.clamp_min_log_ && md_.occupancy_buffer_inflate_[adr] == 0;
+  VersionPin pin = queryPin();
+  const InflateVersion* version = readVersion();
+  return version->state_[adr] != VOXEL_UNKNOWN && version->buffer_[adr] == 0;
 }
 
 inline bool GridMap::isKnownOccupied(const Eigen::Vector3i& id) {
@@ -287,31 +729,8 @@ inline bool GridMap::isKnownOccupied(const Eigen::Vector3i& id) {
   boundIndex(id1);
   int adr = toAddress(id1);
 
-  return md_.occupancy_buffer_inflate_[adr] == 1;
-}
-
-inline void GridMap::setOccupied(Eigen::Vector3d pos) {
-  if (!isInMap(pos)) return;
-
-  Eigen::Vector3i id;
-  posToIndex(pos, id);
-
-  md_.occupancy_buffer_inflate_[id(0) * mp_.map_voxel_num_(1) * mp_.map_voxel_num_(2) +
-                                id(1) * mp_.map_voxel_num_(2) + id(2)] = 1;
-}
-
-inline void GridMap::setOccupancy(Eigen::Vector3d pos, double occ) {
-  if (occ != 1 && occ != 0) {
-    cout << "occ value error!" << endl;
-    return;
-  }
-
-  if (!isInMap(pos)) return;
-
-  Eigen::Vector3i id;
-  posToIndex(pos, id);
-
-  md_.occupancy_buffer_[toAddress(id)] = occ;
+  VersionPin pin = queryPin();
+  return inflateBuffer()[adr] == 1;
 }
 
 inline int GridMap::getOccupancy(Eigen::Vector3d pos) {
@@ -320,7 +739,8 @@ inline int GridMap::getOccupancy(Eigen::Vector3d pos) {
   Eigen::Vector3i id;
   posToIndex(pos, id);
 
-  return md_.occupancy_buffer_[toAddress(id)] > mp_.min_occupancy_log_ ? 1 : 0;
+  VersionPin pin = queryPin();
+  return readVersion()->state_[toAddress(id)] == VOXEL_OCCUPIED ? 1 : 0;
 }
 
 inline int GridMap::getInflateOccupancy(Eigen::Vector3d pos) {
@@ -329,7 +749,8 @@ inline int GridMap::getInflateOccupancy(Eigen::Vector3d pos) {
   Eigen::Vector3i id;
   posToIndex(pos, id);
 
-  return int(md_.occupancy_buffer_inflate_[toAddress(id)]);
+  VersionPin pin = queryPin();
+  return int(inflateBuffer()[toAddress(id)]);
 }
 
 inline int GridMap::getOccupancy(Eigen::Vector3i id) {
@@ -337,7 +758,8 @@ inline int GridMap::getOccupancy(Eigen::Vector3i id) {
       id(2) < 0 || id(2) >= mp_.map_voxel_num_(2))
     return -1;
 
-  return md_.occupancy_buffer_[toAddress(id)] > mp_.min_occupancy_log_ ? 1 : 0;
+  VersionPin pin = queryPin();
+  return readVersion()->state_[toAddress(id)] == VOXEL_OCCUPIED ? 1 : 0;
 }
 
 inline bool GridMap::isInMap(const Eigen::Vector3d& pos) {
@@ -364,6 +786,93 @@ inline bool GridMap::isInMap(const Eigen::Vector3i& idx) {
   return true;
 }
 
+inline const InflateVersion* GridMap::readVersion() {
+  InflateVersion* pinned = pinned_inflate_;
+  if (pinned && pinned->owner_ == this) return pinned;
+  return md_.inflate_current_.load(std::memory_order_acquire);
+}
+
+inline GridMap::VersionPin GridMap::queryPin() {
+  InflateVersion* pinned = pinned_inflate_;
+  if (pinned && pinned->owner_ == this) return VersionPin();
+  return pinVersion();
+}
+
+inline const char* GridMap::inflateBuffer() {
+  return readVersion()->buffer_.data();
+}
+
+inline int GridMap::cloudAddress(const Eigen::Vector3i& id) {
+  const Eigen::Vector3i& reach = md_.inflate_stencil_id_.back();
+  const Eigen::Vector3i num = mp_.map_voxel_num_ + 2 * reach;
+  return ((id(0) + reach(0)) * num(1) + id(1) + reach(1)) * num(2) + id(2) + reach(2);
+}
+
+inline void GridMap::cloudIndex(int adr, Eigen::Vector3i& id) {
+  const Eigen::Vector3i& reach = md_.inflate_stencil_id_.back();
+  const Eigen::Vector3i num = mp_.map_voxel_num_ + 2 * reach;
+  id(2) = adr % num(2) - reach(2);
+  adr /= num(2);
+  id(1) = adr % num(1) - reach(1);
+  id(0) = adr / num(1) - reach(0);
+}
+
+inline bool GridMap::isInCloudGrid(const Eigen::Vector3i& id) {
+  const Eigen::Vector3i& reach = md_.inflate_stencil_id_.back();
+  return (id.array() >= -reach.array()).all() && (id.array() < (mp_.map_voxel_num_ + reach).array()).all();
+}
+
+inline bool GridMap::rangeImageCell(const Eigen::Vector3d& pt, double range, int& row, int& col) {
+  row = (int)lround((asin(pt(2) / range) - md_.range_el0_) / md_.range_vtc_res_);
+  col = (int)lround((atan2(pt(1), pt(0)) - md_.range_az0_) / md_.range_hrz_res_);
+  if (md_.range_wrap_) col = (col + md_.range_cols_) % md_.range_cols_;
+  return row >= 0 && row < md_.range_rows_ && col >= 0 && col < md_.range_cols_;
+}
+
+// log-odds of a voxel once the hits and misses in its counters are applied:
+// every frame that observed it in turn, with the side that won in that frame
+inline double GridMap::countedOccupancy(int adr) {
+  double occ = md_.occupancy_buffer_[adr];
+  const short* votes = &md_.count_votes_[(size_t)adr * mp_.max_coalesced_frames_];
+  for (int frame = 0, frames = md_.count_frames_[adr]; frames; ++frame, frames >>= 1)
+    if (frames & 1) updateProjectiveVoxel(occ, votes[frame] >= 0);
+  return occ;
+}
+
+inline bool GridMap::inObjBox(const Eigen::Vector3d& pt) {
+  if (md_.obj_box_min_.empty() || (pt.array() < md_.obj_bound_min_.array()).any() ||
+      (pt.array() > md_.obj_bound_max_.array()).any())
+    return false;
+
+  for (size_t i = 0; i < md_.obj_box_min_.size(); ++i)
+    if ((pt.array() >= md_.obj_box_min_[i].array()).all() && (pt.array() <= md_.obj_box_max_[i].array()).all())
+      return true;
+  return false;
+}
+
+inline void GridMap::updateProjectiveVoxel(double& occ, bool hit) {
+  double log_odds_update = hit ? mp_.prob_hit_log_ : mp_.prob_miss_log_;
+
+  if (log_odds_update >= 0 && occ >= mp_.clamp_max_log_)
+    return;
+  else if (log_odds_update <= 0 && occ <= mp_.clamp_min_log_) {
+    occ = mp_.clamp_min_log_;
+    return;
+  }
+
+  occ = std::min(std::max(occ + log_odds_update, mp_.clamp_min_log_), mp_.clamp_max_log_);
+}
+
+inline int GridMap::coarseLevel(double range) {
+  int level = 0;
+  while (level < (int)mp_.coarse_ranges_.size() && range >= mp_.coarse_ranges_[level]) ++level;
+  return level;
+}
+
+inline bool GridMap::isInClipBox(const Eigen::Vector3i& id) {
+  return (id.array() >= md_.ray_clip_min_id_.array()).all() && (id.array() <= md_.ray_clip_max_id_.array()).all();
+}
+
 inline void GridMap::posToIndex(const Eigen::Vector3d& pos, Eigen::Vector3i& id) {
   for (int i = 0; i < 3; ++i) id(i) = floor((pos(i) - mp_.map_origin_(i)) * mp_.resolution_inv_);
 }
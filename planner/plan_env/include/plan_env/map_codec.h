@@ -0,0 +1,79 @@
+#ifndef MAP_CODEC_H_
+#define MAP_CODEC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Compact coding of a voxel occupancy grid for low-bandwidth links. The grid
+// is cut into bricks of 8x8x8 voxels; a chunk carries a set of bricks, each
+// as empty, full, runs of equal bits, or its 512 raw bits, whichever is
+// shortest, and the whole payload is deflated with zlib. A keyframe chunk
+// holds every non-empty brick, a delta chunk the bricks changed since the
+// version it is based on. Voxels are addressed x * size[1] * size[2] +
+// y * size[2] + z, as in GridMap, and one byte per voxel is 0 or not.
+
+namespace map_codec {
+
+enum { BRICK_LOG2 = 3, BRICK_EDGE = 1 << BRICK_LOG2, BRICK_VOXELS = BRICK_EDGE * BRICK_EDGE * BRICK_EDGE };
+
+struct MapChunkHeader {
+  uint64_t version;
+  uint64_t base_version;  // version a delta applies to, unused by keyframes
+  bool keyframe;
+  int size[3];            // voxels of the grid
+  double resolution;
+  double origin[3];
+};
+
+// bricks along each axis of a grid of size voxels, and in total
+void brickGrid(const int size[3], int bricks[3]);
+int brickCount(const int size[3]);
+// brick of the voxel at adr
+int brickOf(const int size[3], int adr);
+
+class MapChunkEncoder {
+public:
+  // replace out with a chunk of the given bricks of occupancy, which must be
+  // sorted and unique; level is the zlib level
+  void encode(const MapChunkHeader& header, const char* occupancy, const std::vector<int>& bricks,
+              std::vector<uint8_t>& out, int level = 6);
+
+private:
+  std::vector<uint8_t> payload_;
+};
+
+class MapChunkDecoder {
+public:
+  MapChunkDecoder() : synced_(false) {
+  }
+
+  // apply a chunk to the held map; false if it is corrupt, or a delta that
+  // does not follow the held version, after which only a keyframe applies
+  bool apply(const uint8_t* data, size_t size);
+
+  bool synced() const {
+    return synced_;
+  }
+
+  // grid and version of the last applied chunk
+  const MapChunkHeader& header() const {
+    return header_;
+  }
+
+  const std::vector<char>& occupancy() const {
+    return occupancy_;
+  }
+
+private:
+  bool synced_;
+  MapChunkHeader header_;
+  std::vector<char> occupancy_;
+  std::vector<uint8_t> payload_;
+
+  bool applyPayload(const MapChunkHeader& header);
+};
+
+}  // namespace map_codec
+
+#endif  // MAP_CODEC_H_
@@ -0,0 +1,82 @@
+#ifndef OBJECT_POOL_H_
+#define OBJECT_POOL_H_
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/* Free list of heap objects that are handed out again instead of being
+ * deleted. A Ptr puts its object back when it goes out of scope, so once the
+ * pool has grown to the number of objects in flight, acquire() no longer
+ * allocates. Objects keep their buffers between uses and are not reset; the
+ * caller clears what it relies on. The pool must outlive its Ptrs. */
+template <typename T>
+class ObjectPool {
+public:
+  struct Recycler {
+    ObjectPool* pool;
+
+    Recycler(ObjectPool* owner = nullptr) : pool(owner) {
+    }
+
+    void operator()(T* item) const {
+      if (pool)
+        pool->release(item);
+      else
+        delete item;
+    }
+  };
+  typedef std::unique_ptr<T, Recycler> Ptr;
+
+  ObjectPool() : created_(0) {
+  }
+
+  ~ObjectPool() {
+    for (T* item : free_) delete item;
+  }
+
+  // not thread safe, call before the first acquire
+  void reserve(size_t count) {
+    free_.reserve(count);
+    while (created_ < count) {
+      free_.push_back(new T);
+      created_++;
+    }
+  }
+
+  Ptr acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!free_.empty()) {
+        T* item = free_.back();
+        free_.pop_back();
+        return Ptr(item, Recycler(this));
+      }
+      // room for every object to come back without growing the list then
+      created_++;
+      free_.reserve(created_);
+    }
+    return Ptr(new T, Recycler(this));
+  }
+
+  // takes back an object that left through Ptr::release()
+  Ptr adopt(T* item) {
+    return Ptr(item, Recycler(this));
+  }
+
+  Recycler recycler() {
+    return Recycler(this);
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<T*> free_;
+  size_t created_;
+
+  void release(T* item) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(item);
+  }
+};
+
+#endif  // OBJECT_POOL_H_
@@ -0,0 +1,107 @@
+#ifndef POSE_BUFFER_H_
+#define POSE_BUFFER_H_
+
+#include <Eigen/Eigen>
+#include <atomic>
+#include <cstdint>
+
+/* Ring of the most recent stamped poses, written by one thread and read by
+ * any. Every slot is a seqlock: the writer marks it odd while it stores the
+ * sample and even with its sample number afterwards, so a reader that raced
+ * the writer sees a changed counter and treats the slot as overwritten.
+ * Neither side ever waits. Stamps are expected in increasing order. */
+class PoseBuffer {
+public:
+  enum { CAPACITY = 256 };
+  enum Result { OK, EMPTY, TOO_OLD, TOO_NEW };
+
+  PoseBuffer() : head_(0) {
+    for (Slot& slot : slots_) {
+      slot.seq.store(0, std::memory_order_relaxed);
+      for (std::atomic<double>& v : slot.value) v.store(0.0, std::memory_order_relaxed);
+    }
+  }
+
+  // false if the stamp does not follow the newest sample
+  bool push(double stamp, const Eigen::Vector3d& pos, const Eigen::Quaterniond& q) {
+    const uint64_t i = head_.load(std::memory_order_relaxed);
+    if (i > 0 && stamp <= newestStamp()) return false;
+
+    Slot& slot = slots_[i % CAPACITY];
+    slot.seq.store(2 * i + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    const double value[8] = { stamp, pos(0), pos(1), pos(2), q.w(), q.x(), q.y(), q.z() };
+    for (int k = 0; k < 8; ++k) slot.value[k].store(value[k], std::memory_order_relaxed);
+    slot.seq.store(2 * i + 2, std::memory_order_release);
+
+    head_.store(i + 1, std::memory_order_release);
+    return true;
+  }
+
+  // pose at stamp, linear in position and slerp in rotation between the two
+  // samples around it; TOO_NEW still returns the newest sample
+  Result interpolate(double stamp, Eigen::Vector3d& pos, Eigen::Quaterniond& q) const {
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    if (head == 0) return EMPTY;
+
+    const uint64_t oldest = head > CAPACITY ? head - CAPACITY : 0;
+    double newer[8], cur[8];
+    bool has_newer = false;
+
+    for (uint64_t i = head; i-- > oldest;) {
+      // a slot the writer got to first ends the history
+      if (!read(i, cur)) break;
+
+      if (cur[0] <= stamp) {
+        if (!has_newer) {
+          toPose(cur, pos, q);
+          return cur[0] == stamp ? OK : TOO_NEW;
+        }
+        const double a = (stamp - cur[0]) / (newer[0] - cur[0]);
+        Eigen::Vector3d pos0, pos1;
+        Eigen::Quaterniond q0, q1;
+        toPose(cur, pos0, q0);
+        toPose(newer, pos1, q1);
+        pos = pos0 + a * (pos1 - pos0);
+        q = q0.slerp(a, q1);
+        return OK;
+      }
+
+      for (int k = 0; k < 8; ++k) newer[k] = cur[k];
+      has_newer = true;
+    }
+    return TOO_OLD;
+  }
+
+  double newestStamp() const {
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    double value[8];
+    return head > 0 && read(head - 1, value) ? value[0] : 0.0;
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    std::atomic<double> value[8];  // stamp, position, quaternion w x y z
+  };
+
+  Slot slots_[CAPACITY];
+  std::atomic<uint64_t> head_;
+
+  // copy sample i, false if the slot no longer holds it
+  bool read(uint64_t i, double* value) const {
+    const Slot& slot = slots_[i % CAPACITY];
+    const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+    if (seq != 2 * i + 2) return false;
+    for (int k = 0; k < 8; ++k) value[k] = slot.value[k].load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.seq.load(std::memory_order_relaxed) == seq;
+  }
+
+  static void toPose(const double* value, Eigen::Vector3d& pos, Eigen::Quaterniond& q) {
+    pos = Eigen::Vector3d(value[1], value[2], value[3]);
+    q = Eigen::Quaterniond(value[4], value[5], value[6], value[7]);
+  }
+};
+
+#endif  // POSE_BUFFER_H_
@@ -2,13 +2,14 @@
 #define RAYCAST_H_
 
 #include <Eigen/Eigen>
+#include <cstdint>
+#include <limits>
 #include <vector>
 
-double signum(double x);
-
-double mod(double value, double modulus);
-
-double intbound(double s, double ds);
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RAYCAST_HAS_AVX2_PATH
+#include <immintrin.h>
+#endif
 
 void Raycast(const Eigen::Vector3d& start, const Eigen::Vector3d& end, const Eigen::Vector3d& min,
              const Eigen::Vector3d& max, int& output_points_cnt, Eigen::Vector3d* output);
@@ -16,48 +17,247 @@ void Raycast(const Eigen::Vector3d& start, const Eigen::Vector3d& end, const Eig
 void Raycast(const Eigen::Vector3d& start, const Eigen::Vector3d& end, const Eigen::Vector3d& min,
              const Eigen::Vector3d& max, std::vector<Eigen::Vector3d>* output);
 
+/* Amanatides-Woo traversal between the centres of two voxels, done entirely
+ * in integers. The boundary crossing parameter of each axis is scaled by the
+ * product of the non-zero axis lengths, so choosing the next axis is an
+ * exact integer compare, and the walk reaches the end voxel in exactly
+ * |dx| + |dy| + |dz| steps. A linear buffer address is stepped along with
+ * the voxel index when strides are given. */
 class RayCaster {
 private:
+  friend class RayPacket;
+
   /* data */
-  Eigen::Vector3d start_;
-  Eigen::Vector3d end_;
-  Eigen::Vector3d direction_;
-  Eigen::Vector3d min_;
-  Eigen::Vector3d max_;
-  int x_;
-  int y_;
-  int z_;
-  int endX_;
-  int endY_;
-  int endZ_;
-  double maxDist_;
-  double dx_;
-  double dy_;
-  double dz_;
-  int stepX_;
-  int stepY_;
-  int stepZ_;
-  double tMaxX_;
-  double tMaxY_;
-  double tMaxZ_;
-  double tDeltaX_;
-  double tDeltaY_;
-  double tDeltaZ_;
-  double dist_;
-
-  int step_num_;
+  Eigen::Vector3i id_;
+  Eigen::Vector3i end_;
+  int step_[3];
+  int64_t t_max_[3];
+  int64_t t_delta_[3];
+  int adr_;
+  int adr_step_[3];
+  int remain_;
 
 public:
-  RayCaster(/* args */) {
+  RayCaster(/* args */) : remain_(0) {
   }
   ~RayCaster() {
   }
 
-  bool setInput(const Eigen::Vector3d& start,
-                const Eigen::Vector3d& end /* , const Eigen::Vector3d& min,
-                const Eigen::Vector3d& max */);
+  // start and end are voxel coordinates, the ray begins in start's voxel
+  bool setInput(const Eigen::Vector3i& start, const Eigen::Vector3i& end, int start_adr = 0,
+                const Eigen::Vector3i& stride = Eigen::Vector3i::Zero());
+
+  // start and end in voxel units, floored to the containing voxels
+  bool setInput(const Eigen::Vector3d& start, const Eigen::Vector3d& end);
 
   bool step(Eigen::Vector3d& ray_pt);
+
+  inline void advance();
+
+  // call visit(address) on every voxel from the current one up to, but not
+  // including, the end voxel; the walk stops early when visit returns false
+  template <typename Visitor>
+  inline void traverse(Visitor& visit);
+
+  const Eigen::Vector3i& index() const {
+    return id_;
+  }
+  int address() const {
+    return adr_;
+  }
+  int remaining() const {
+    return remain_;
+  }
+};
+
+inline void RayCaster::advance() {
+  // choosing the least crossing parameter chooses the closest cube boundary
+  int a = t_max_[0] < t_max_[1] ? (t_max_[0] < t_max_[2] ? 0 : 2) : (t_max_[1] < t_max_[2] ? 1 : 2);
+  id_(a) += step_[a];
+  adr_ += adr_step_[a];
+  t_max_[a] += t_delta_[a];
+  --remain_;
+}
+
+template <typename Visitor>
+inline void RayCaster::traverse(Visitor& visit) {
+  while (remain_ > 0) {
+    if (!visit(adr_)) return;
+    advance();
+  }
+}
+
+/* Lock-step traversal of up to eight RayCaster walks with AVX2. Every lane
+ * keeps the integer state of its ray; axis selection is done for all lanes
+ * at once with compares and masks, so the walk has no data-dependent
+ * branches. The visitor is still called once per lane and step, in lane
+ * order. When fewer than kMinLanes rays remain active the packet finishes
+ * them one by one. Without AVX2 the lanes are simply walked in turn. */
+class RayPacket {
+public:
+  static const int kLanes = 8;
+  static const int kMinLanes = 3;
+
+  RayPacket() : lanes_(0) {
+  }
+
+  // false when the ray is empty or its crossings overflow 32-bit lanes
+  bool add(const RayCaster& ray);
+
+  int size() const {
+    return lanes_;
+  }
+  bool full() const {
+    return lanes_ == kLanes;
+  }
+
+  // walk and empty the packet
+  template <typename Visitor>
+  inline void traverse(Visitor& visit);
+
+  static bool avx2Supported();
+
+private:
+  alignas(32) int adr_[kLanes];
+  alignas(32) int remain_[kLanes];
+  alignas(32) int t_max_[3][kLanes];
+  alignas(32) int t_delta_[3][kLanes];
+  alignas(32) int adr_step_[3][kLanes];
+  int lanes_;
+
+  template <typename Visitor>
+  inline void traverseLane(int l, Visitor& visit);
+
+#ifdef RAYCAST_HAS_AVX2_PATH
+  template <typename Visitor>
+  __attribute__((target("avx2"))) void traverseAvx2(Visitor& visit);
+#endif
 };
 
-#endif  // RAYCAST_H_
\ No newline at end of file
+inline bool RayPacket::add(const RayCaster& ray) {
+  if (ray.remain_ <= 0) return false;
+
+  const int l = lanes_;
+  for (int i = 0; i < 3; ++i) {
+    if (ray.t_delta_[i] == 0) {
+      t_max_[i][l] = std::numeric_limits<int>::max();
+      t_delta_[i][l] = 0;
+    } else {
+      if (ray.t_max_[i] + ray.remain_ * ray.t_delta_[i] >= std::numeric_limits<int>::max()) return false;
+      t_max_[i][l] = (int)ray.t_max_[i];
+      t_delta_[i][l] = (int)ray.t_delta_[i];
+    }
+    adr_step_[i][l] = ray.adr_step_[i];
+  }
+  adr_[l] = ray.adr_;
+  remain_[l] = ray.remain_;
+  ++lanes_;
+  return true;
+}
+
+inline bool RayPacket::avx2Supported() {
+#ifdef RAYCAST_HAS_AVX2_PATH
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+template <typename Visitor>
+inline void RayPacket::traverseLane(int l, Visitor& visit) {
+  while (remain_[l] > 0) {
+    if (!visit(adr_[l])) break;
+    // same tie breaking as RayCaster::advance
+    int a = t_max_[0][l] < t_max_[1][l] ? (t_max_[0][l] < t_max_[2][l] ? 0 : 2)
+                                         : (t_max_[1][l] < t_max_[2][l] ? 1 : 2);
+    adr_[l] += adr_step_[a][l];
+    t_max_[a][l] += t_delta_[a][l];
+    --remain_[l];
+  }
+  remain_[l] = 0;
+}
+
+template <typename Visitor>
+inline void RayPacket::traverse(Visitor& visit) {
+  if (lanes_ == 0) return;
+
+#ifdef RAYCAST_HAS_AVX2_PATH
+  if (lanes_ >= kMinLanes && avx2Supported()) {
+    for (int l = lanes_; l < kLanes; ++l) remain_[l] = 0;
+    traverseAvx2(visit);
+    lanes_ = 0;
+    return;
+  }
+#endif
+
+  for (int l = 0; l < lanes_; ++l) traverseLane(l, visit);
+  lanes_ = 0;
+}
+
+#ifdef RAYCAST_HAS_AVX2_PATH
+template <typename Visitor>
+__attribute__((target("avx2"))) void RayPacket::traverseAvx2(Visitor& visit) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi32(1);
+
+  __m256i adr = _mm256_load_si256((const __m256i*)adr_);
+  __m256i remain = _mm256_load_si256((const __m256i*)remain_);
+  __m256i tx = _mm256_load_si256((const __m256i*)t_max_[0]);
+  __m256i ty = _mm256_load_si256((const __m256i*)t_max_[1]);
+  __m256i tz = _mm256_load_si256((const __m256i*)t_max_[2]);
+  const __m256i dx = _mm256_load_si256((const __m256i*)t_delta_[0]);
+  const __m256i dy = _mm256_load_si256((const __m256i*)t_delta_[1]);
+  const __m256i dz = _mm256_load_si256((const __m256i*)t_delta_[2]);
+  const __m256i ax = _mm256_load_si256((const __m256i*)adr_step_[0]);
+  const __m256i ay = _mm256_load_si256((const __m256i*)adr_step_[1]);
+  const __m256i az = _mm256_load_si256((const __m256i*)adr_step_[2]);
+
+  alignas(32) int lane_adr[kLanes];
+  alignas(32) int lane_kill[kLanes] = { 0 };
+
+  __m256i active = _mm256_cmpgt_epi32(remain, zero);
+  int mask = _mm256_movemask_ps(_mm256_castsi256_ps(active));
+
+  while (__builtin_popcount(mask) >= kMinLanes) {
+    _mm256_store_si256((__m256i*)lane_adr, adr);
+
+    for (int m = mask; m; m &= m - 1) {
+      int l = __builtin_ctz(m);
+      if (!visit(lane_adr[l])) lane_kill[l] = -1;
+    }
+    active = _mm256_andnot_si256(_mm256_load_si256((const __m256i*)lane_kill), active);
+
+    // x if tx < ty && tx < tz, else y if ty < tz, else z
+    __m256i x_lt_y = _mm256_cmpgt_epi32(ty, tx);
+    __m256i cx = _mm256_and_si256(x_lt_y, _mm256_cmpgt_epi32(tz, tx));
+    __m256i cy = _mm256_andnot_si256(x_lt_y, _mm256_cmpgt_epi32(tz, ty));
+    __m256i cz = _mm256_andnot_si256(_mm256_or_si256(cx, cy), active);
+    cx = _mm256_and_si256(cx, active);
+    cy = _mm256_and_si256(cy, active);
+
+    tx = _mm256_add_epi32(tx, _mm256_and_si256(cx, dx));
+    ty = _mm256_add_epi32(ty, _mm256_and_si256(cy, dy));
+    tz = _mm256_add_epi32(tz, _mm256_and_si256(cz, dz));
+    __m256i step = _mm256_or_si256(_mm256_and_si256(cx, ax),
+                                   _mm256_or_si256(_mm256_and_si256(cy, ay), _mm256_and_si256(cz, az)));
+    adr = _mm256_add_epi32(adr, step);
+    remain = _mm256_sub_epi32(remain, _mm256_and_si256(active, one));
+
+    active = _mm256_and_si256(active, _mm256_cmpgt_epi32(remain, zero));
+    mask = _mm256_movemask_ps(_mm256_castsi256_ps(active));
+  }
+
+  if (!mask) return;
+
+  // divergent tail: finish the remaining lanes one ray at a time
+  _mm256_store_si256((__m256i*)adr_, adr);
+  _mm256_store_si256((__m256i*)remain_, _mm256_and_si256(remain, active));
+  _mm256_store_si256((__m256i*)t_max_[0], tx);
+  _mm256_store_si256((__m256i*)t_max_[1], ty);
+  _mm256_store_si256((__m256i*)t_max_[2], tz);
+  for (int m = mask; m; m &= m - 1) traverseLane(__builtin_ctz(m), visit);
+}
+#endif
+
+#endif  // RAYCAST_H_
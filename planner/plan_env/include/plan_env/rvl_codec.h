@@ -0,0 +1,20 @@
+#ifndef RVL_CODEC_H_
+#define RVL_CODEC_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Run length / variable length (RVL) coding of 16-bit depth, as used by
+// compressed_depth_image_transport. Runs of empty pixels and of valid ones
+// alternate; valid pixels are stored as zigzag deltas to their predecessor,
+// and all numbers are written as 3-bit groups in nibbles packed into 32-bit
+// words. Lossless, and cheap enough to decode at camera rate on one core.
+
+// append the code of num_pixels depths to out
+void encodeRvl(const uint16_t* depth, int num_pixels, std::vector<uint8_t>& out);
+
+// false if data ends early or describes more than num_pixels depths
+bool decodeRvl(const uint8_t* data, size_t size, uint16_t* depth, int num_pixels);
+
+#endif  // RVL_CODEC_H_
@@ -0,0 +1,164 @@
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/* Bounded single-producer/single-consumer ring of owned T*, where T carries
+ * a uint64_t seq_ that the ring assigns. The producer never blocks: it
+ * swaps its item into the slot of its sequence number, and an item it finds
+ * there was never consumed, so it is dropped as the oldest one. Because
+ * slots are overwritten in place, the consumer can meet items older than
+ * one it already took; those are dropped too, so items always leave in
+ * order. Only a consumer that runs dry takes the mutex, to sleep. Dropped
+ * items go to Deleter. A consumer that waits on something else besides new
+ * items sleeps in popUntil, and whoever brings it pokes the ring. */
+template <typename T, typename Deleter = std::default_delete<T>>
+class SpscRing {
+public:
+  SpscRing() : head_(0), tail_(0), dropped_(0), sleeping_(false), poked_(false), closed_(false) {
+  }
+
+  ~SpscRing() {
+    clearSlots();
+  }
+
+  // not thread safe, call before the first push
+  void init(size_t capacity, Deleter deleter = Deleter()) {
+    clearSlots();
+    deleter_ = deleter;
+    std::vector<std::atomic<T*>> slots(capacity < 1 ? 1 : capacity);
+    slots_.swap(slots);
+    for (std::atomic<T*>& slot : slots_) slot.store(nullptr);
+  }
+
+  // producer side, takes ownership
+  void push(T* item) {
+    const uint64_t seq = head_.load(std::memory_order_relaxed);
+    item->seq_ = seq;
+
+    T* old = slots_[seq % slots_.size()].exchange(item, std::memory_order_acq_rel);
+    if (old) {
+      deleter_(old);
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+    head_.store(seq + 1, std::memory_order_seq_cst);
+
+    if (sleeping_.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      wake_.notify_one();
+    }
+  }
+
+  // consumer side: waits for at least one item and takes up to max_items in
+  // order; false once closed
+  bool popAll(std::vector<T*>& items, size_t max_items) {
+    items.clear();
+    while (items.empty()) {
+      if (!takeAvailable(items, max_items)) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        sleeping_.store(true, std::memory_order_seq_cst);
+        wake_.wait(lock, [this] {
+          return closed_ || head_.load(std::memory_order_seq_cst) > tail_.load(std::memory_order_relaxed);
+        });
+        sleeping_.store(false, std::memory_order_relaxed);
+        if (closed_ && head_.load() <= tail_.load(std::memory_order_relaxed)) return false;
+      }
+    }
+    return true;
+  }
+
+  // consumer side: as popAll, but also returns with no items at deadline or
+  // after a poke(); with max_items 0 it only waits for those
+  bool popUntil(std::vector<T*>& items, size_t max_items, std::chrono::steady_clock::time_point deadline) {
+    items.clear();
+    poked_.store(false, std::memory_order_seq_cst);
+    if (takeAvailable(items, max_items)) return true;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      sleeping_.store(true, std::memory_order_seq_cst);
+      wake_.wait_until(lock, deadline, [this, max_items] {
+        return closed_ || poked_.load(std::memory_order_seq_cst) ||
+               (max_items > 0 && head_.load(std::memory_order_seq_cst) > tail_.load(std::memory_order_relaxed));
+      });
+      sleeping_.store(false, std::memory_order_relaxed);
+    }
+    return takeAvailable(items, max_items) || !closed_;
+  }
+
+  // wakes a consumer in popUntil, from any thread; popAll sleeps on
+  void poke() {
+    poked_.store(true, std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      wake_.notify_one();
+    }
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    wake_.notify_all();
+  }
+
+  uint64_t dropped() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  // items pushed but not yet taken, dropped ones included
+  int depth() const {
+    const uint64_t tail = tail_.load(std::memory_order_relaxed);
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    return head > tail ? (int)(head - tail) : 0;
+  }
+
+private:
+  std::vector<std::atomic<T*>> slots_;
+  std::atomic<uint64_t> head_, tail_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<bool> sleeping_, poked_;
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  bool closed_;
+  Deleter deleter_;
+
+  void clearSlots() {
+    for (std::atomic<T*>& slot : slots_) {
+      T* item = slot.exchange(nullptr);
+      if (item) deleter_(item);
+    }
+  }
+
+  bool takeAvailable(std::vector<T*>& items, size_t max_items) {
+    const uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    const uint64_t size = slots_.size();
+
+    // an item can be taken before the producer has published its head, so
+    // tail may already be past the head read here
+    if (head <= tail) return false;
+    // everything older than one lap behind the producer is overwritten
+    if (head - tail > size) tail = head - size;
+
+    for (; tail < head && items.size() < max_items; ++tail) {
+      T* item = slots_[tail % size].exchange(nullptr, std::memory_order_acq_rel);
+      if (!item) continue;
+      if (item->seq_ < tail) {
+        deleter_(item);
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      tail = item->seq_;
+      items.push_back(item);
+    }
+    tail_.store(tail, std::memory_order_relaxed);
+    return !items.empty();
+  }
+};
+
+#endif  // SPSC_RING_H_
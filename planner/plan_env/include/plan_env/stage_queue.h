@@ -0,0 +1,85 @@
+#ifndef STAGE_QUEUE_H_
+#define STAGE_QUEUE_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+/* Bounded handoff queue between two fusion stages. push() blocks while the
+ * queue is full, so a slow stage holds back the one feeding it. After
+ * close() pushes are refused and pop() returns false once the queue has been
+ * drained. Items sit in a fixed ring, so passing them never allocates. */
+template <typename T>
+class StageQueue {
+public:
+  explicit StageQueue(size_t capacity = 1) : items_(capacity < 1 ? 1 : capacity), head_(0), size_(0), closed_(false) {
+  }
+
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return closed_ || size_ < items_.size(); });
+    if (closed_) return false;
+    items_[(head_ + size_) % items_.size()] = std::move(item);
+    size_++;
+    lock.unlock();
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // not thread safe with a stage waiting on the queue, call before the
+  // stages start
+  void setCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<T> items(capacity < 1 ? 1 : capacity);
+    for (size_t i = 0; i < size_ && i < items.size(); ++i) items[i] = std::move(items_[(head_ + i) % items_.size()]);
+    size_ = size_ < items.size() ? size_ : items.size();
+    head_ = 0;
+    items_.swap(items);
+  }
+
+  // waits for at least one item and takes up to max_items of them
+  bool popAll(std::vector<T>& items, size_t max_items) {
+    items.clear();
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return closed_ || size_ > 0; });
+    while (size_ > 0 && items.size() < max_items) items.push_back(takeFront());
+    lock.unlock();
+    not_full_.notify_all();
+    return !items.empty();
+  }
+
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return closed_ || size_ > 0; });
+    if (size_ == 0) return false;
+    item = takeFront();
+    lock.unlock();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable not_empty_, not_full_;
+  std::vector<T> items_;
+  size_t head_, size_;
+  bool closed_;
+
+  T takeFront() {
+    T item = std::move(items_[head_]);
+    head_ = (head_ + 1) % items_.size();
+    size_--;
+    return item;
+  }
+};
+
+#endif  // STAGE_QUEUE_H_
@@ -0,0 +1,174 @@
+#ifndef VOXEL_HASH_H_
+#define VOXEL_HASH_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/* Flat open-addressing set of linear voxel addresses. Slots are tagged with
+ * a generation stamp, so clear() is O(1) and the table can be reused for
+ * every batch of rays without touching its memory. */
+class VoxelHashSet {
+public:
+  explicit VoxelHashSet(int capacity_log2 = 12) {
+    reserve(capacity_log2);
+  }
+
+  void clear() {
+    size_ = 0;
+    if (++stamp_ == 0) {
+      std::fill(stamps_.begin(), stamps_.end(), 0);
+      stamp_ = 1;
+    }
+  }
+
+  // true if adr was not in the set before
+  inline bool insert(int adr);
+  inline bool contains(int adr) const;
+
+  int size() const {
+    return size_;
+  }
+
+private:
+  std::vector<int> keys_;
+  std::vector<uint32_t> stamps_;
+  uint32_t stamp_;
+  int bits_, mask_, size_;
+
+  void reserve(int capacity_log2) {
+    bits_ = capacity_log2;
+    mask_ = (1 << bits_) - 1;
+    keys_.assign(mask_ + 1, 0);
+    stamps_.assign(mask_ + 1, 0);
+    stamp_ = 1;
+    size_ = 0;
+  }
+
+  inline int slot(int adr) const {
+    return (int)(((uint32_t)adr * 0x9e3779b1u) >> (32 - bits_));
+  }
+
+  void grow() {
+    std::vector<int> keys;
+    keys.reserve(size_);
+    for (int i = 0; i <= mask_; ++i)
+      if (stamps_[i] == stamp_) keys.push_back(keys_[i]);
+    reserve(bits_ + 1);
+    for (int k : keys) insert(k);
+  }
+};
+
+inline bool VoxelHashSet::insert(int adr) {
+  if (2 * (size_ + 1) > mask_ + 1) grow();
+
+  for (int i = slot(adr);; i = (i + 1) & mask_) {
+    if (stamps_[i] != stamp_) {
+      stamps_[i] = stamp_;
+      keys_[i] = adr;
+      ++size_;
+      return true;
+    }
+    if (keys_[i] == adr) return false;
+  }
+}
+
+inline bool VoxelHashSet::contains(int adr) const {
+  for (int i = slot(adr);; i = (i + 1) & mask_) {
+    if (stamps_[i] != stamp_) return false;
+    if (keys_[i] == adr) return true;
+  }
+}
+
+/* The same table with a value per address. A slot reused after clear()
+ * starts again from T(). */
+template <typename T>
+class VoxelHashMap {
+public:
+  explicit VoxelHashMap(int capacity_log2 = 12) {
+    reserve(capacity_log2);
+  }
+
+  void clear() {
+    size_ = 0;
+    if (++stamp_ == 0) {
+      std::fill(stamps_.begin(), stamps_.end(), 0);
+      stamp_ = 1;
+    }
+  }
+
+  // value of adr, added as T() when missing; the reference is valid until
+  // the next insert
+  inline T& insert(int adr, bool& inserted);
+  inline T* find(int adr);
+
+  int size() const {
+    return size_;
+  }
+
+private:
+  std::vector<int> keys_;
+  std::vector<T> values_;
+  std::vector<uint32_t> stamps_;
+  uint32_t stamp_;
+  int bits_, mask_, size_;
+
+  void reserve(int capacity_log2) {
+    bits_ = capacity_log2;
+    mask_ = (1 << bits_) - 1;
+    keys_.assign(mask_ + 1, 0);
+    values_.assign(mask_ + 1, T());
+    stamps_.assign(mask_ + 1, 0);
+    stamp_ = 1;
+    size_ = 0;
+  }
+
+  inline int slot(int adr) const {
+    return (int)(((uint32_t)adr * 0x9e3779b1u) >> (32 - bits_));
+  }
+
+  void grow() {
+    std::vector<int> keys;
+    std::vector<T> values;
+    keys.reserve(size_);
+    values.reserve(size_);
+    for (int i = 0; i <= mask_; ++i)
+      if (stamps_[i] == stamp_) {
+        keys.push_back(keys_[i]);
+        values.push_back(values_[i]);
+      }
+    reserve(bits_ + 1);
+    bool inserted;
+    for (size_t i = 0; i < keys.size(); ++i) insert(keys[i], inserted) = values[i];
+  }
+};
+
+template <typename T>
+inline T& VoxelHashMap<T>::insert(int adr, bool& inserted) {
+  if (2 * (size_ + 1) > mask_ + 1) grow();
+
+  for (int i = slot(adr);; i = (i + 1) & mask_) {
+    if (stamps_[i] != stamp_) {
+      stamps_[i] = stamp_;
+      keys_[i] = adr;
+      values_[i] = T();
+      ++size_;
+      inserted = true;
+      return values_[i];
+    }
+    if (keys_[i] == adr) {
+      inserted = false;
+      return values_[i];
+    }
+  }
+}
+
+template <typename T>
+inline T* VoxelHashMap<T>::find(int adr) {
+  for (int i = slot(adr);; i = (i + 1) & mask_) {
+    if (stamps_[i] != stamp_) return nullptr;
+    if (keys_[i] == adr) return &values_[i];
+  }
+}
+
+#endif  // VOXEL_HASH_H_
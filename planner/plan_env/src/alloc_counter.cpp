@@ -0,0 +1,84 @@
+#include "plan_env/alloc_counter.h"
+
+#ifdef PLAN_ENV_COUNT_ALLOCS
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+thread_local uint64_t thread_allocs = 0;
+}
+
+void *operator new(std::size_t size)
+{
+  ++thread_allocs;
+  if (void *ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+  return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+  ++thread_allocs;
+  return std::malloc(size ? size : 1);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept
+{
+  return operator new(size, tag);
+}
+
+void operator delete(void *ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept
+{
+  std::free(ptr);
+}
+
+namespace alloc_counter
+{
+bool enabled()
+{
+  return true;
+}
+
+uint64_t threadAllocations()
+{
+  return thread_allocs;
+}
+}  // namespace alloc_counter
+
+#else
+
+namespace alloc_counter
+{
+bool enabled()
+{
+  return false;
+}
+
+uint64_t threadAllocations()
+{
+  return 0;
+}
+}  // namespace alloc_counter
+
+#endif
@@ -0,0 +1,84 @@
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include <plan_env/depth_pool.h>
+
+#if defined(__SSE4_1__)
+#include <smmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Depths are pooled with a bias of -min_valid, so that every valid depth
+// maps below the ones too close to trust, which wrap to the top of the range
+// (one further down, to stay clear of 0xffff), and an empty pixel (0) is set
+// to 0xffff to lose against both. Undoing the bias restores the winning depth;
+// an all-empty block becomes 0 again.
+
+static inline void minRowBiased(const uint16_t* src, uint16_t* acc, int n, uint16_t bias, bool first) {
+  int i = 0;
+#if defined(__SSE4_1__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i vbias = _mm_set1_epi16((short)bias);
+  const __m128i below = _mm_set1_epi16((short)(bias - 1));
+  for (; i + 8 <= n; i += 8) {
+    __m128i d = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i near = _mm_cmpeq_epi16(_mm_min_epu16(d, below), d);
+    __m128i v = _mm_add_epi16(_mm_sub_epi16(d, vbias), near);
+    v = _mm_or_si128(v, _mm_cmpeq_epi16(d, zero));
+    if (!first) v = _mm_min_epu16(v, _mm_loadu_si128((const __m128i*)(acc + i)));
+    _mm_storeu_si128((__m128i*)(acc + i), v);
+  }
+#elif defined(__ARM_NEON)
+  const uint16x8_t vbias = vdupq_n_u16(bias);
+  for (; i + 8 <= n; i += 8) {
+    uint16x8_t d = vld1q_u16(src + i);
+    uint16x8_t v = vaddq_u16(vsubq_u16(d, vbias), vcltq_u16(d, vbias));
+    v = vorrq_u16(v, vceqq_u16(d, vdupq_n_u16(0)));
+    if (!first) v = vminq_u16(v, vld1q_u16(acc + i));
+    vst1q_u16(acc + i, v);
+  }
+#endif
+  for (; i < n; ++i) {
+    uint16_t v = src[i] ? (uint16_t)(src[i] - bias - (src[i] < bias)) : (uint16_t)0xffff;
+    acc[i] = first ? v : std::min(acc[i], v);
+  }
+}
+
+void minPoolDepth(const cv::Mat& src, int margin, int factor, int min_valid, cv::Mat& dst) {
+  margin = std::max(margin, 0);
+  factor = std::max(factor, 1);
+  const uint16_t bias = (uint16_t)std::min(std::max(min_valid, 1), 0xffff);
+
+  const int width = src.cols - 2 * margin;
+  const int height = src.rows - 2 * margin;
+  if (width <= 0 || height <= 0) {
+    dst.create(0, 0, CV_16UC1);
+    return;
+  }
+
+  const int out_cols = (width + factor - 1) / factor;
+  const int out_rows = (height + factor - 1) / factor;
+  dst.create(out_rows, out_cols, CV_16UC1);
+
+  // vertical min of one block row, reused across frames
+  static thread_local std::vector<uint16_t> acc;
+  acc.resize(width);
+
+  for (int r = 0; r < out_rows; ++r) {
+    const int v0 = margin + r * factor;
+    const int v1 = std::min(v0 + factor, margin + height);
+
+    for (int v = v0; v < v1; ++v)
+      minRowBiased(src.ptr<uint16_t>(v) + margin, acc.data(), width, bias, v == v0);
+
+    uint16_t* out = dst.ptr<uint16_t>(r);
+    for (int c = 0; c < out_cols; ++c) {
+      const int u0 = c * factor;
+      const int u1 = std::min(u0 + factor, width);
+      uint16_t m = acc[u0];
+      for (int u = u0 + 1; u < u1; ++u) m = std::min(m, acc[u]);
+      out[c] = m == 0xffff ? 0 : (uint16_t)(m + bias + (m > 0xffff - bias));
+    }
+  }
+}
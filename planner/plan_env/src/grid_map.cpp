@@ -1,4 +1,40 @@
 #include "plan_env/grid_map.h"
+#include "plan_env/obj_predictor.h"
+#include "plan_env/rvl_codec.h"
+
+#include <chrono>
+#include <cstring>
+#include <numeric>
+#include <opencv2/imgcodecs.hpp>
+#include <pthread.h>
+#include <sensor_msgs/point_cloud2_iterator.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static inline int fusionThreadId()
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+thread_local InflateVersion *GridMap::pinned_inflate_ = nullptr;
+
+static inline int fusionMaxThreads()
+{
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
 
 // #define current_img_ md_.depth_image_[image_cnt_ & 1]
 // #define last_img_ md_.depth_image_[!(image_cnt_ & 1)]
@@ -30,6 +66,27 @@ void GridMap::initMap(ros::NodeHandle &nh)
   node_.param("grid_map/depth_filter_margin", mp_.depth_filter_margin_, -1);
   node_.param("grid_map/k_depth_scaling_factor", mp_.k_depth_scaling_factor_, -1.0);
   node_.param("grid_map/skip_pixel", mp_.skip_pixel_, -1);
+  node_.param("grid_map/use_min_pool", mp_.use_min_pool_, true);
+  // a depth the filter drops must not hide the real return of its block
+  mp_.pool_min_raw_ =
+      mp_.use_depth_filter_ ? max(1, (int)ceil(mp_.depth_filter_mindist_ * mp_.k_depth_scaling_factor_)) : 1;
+
+  node_.param("grid_map/lidar_vtc_line_num", mp_.lidar_vtc_line_num_, 0);
+  node_.param("grid_map/lidar_hrz_line_num", mp_.lidar_hrz_line_num_, 360);
+  node_.param("grid_map/lidar_vtc_range_dgr", mp_.lidar_vtc_range_, 30.0);
+  node_.param("grid_map/lidar_hrz_range_dgr", mp_.lidar_hrz_range_, 360.0);
+  node_.param("grid_map/lidar_pool", mp_.lidar_pool_, 1);
+  node_.param("grid_map/lidar_skip_scans", mp_.lidar_skip_scans_, 0);
+  node_.param("grid_map/lidar_no_return_free", mp_.lidar_no_return_free_, false);
+  mp_.lidar_vtc_range_ *= M_PI / 180.0;
+  mp_.lidar_hrz_range_ *= M_PI / 180.0;
+  mp_.lidar_pool_ = max(mp_.lidar_pool_, 1);
+
+  // off: nothing in the planner feeds setObjPrediction yet, and projective
+  // fusion ignores the masks anyway
+  node_.param("grid_map/mask_dynamic_objects", mp_.mask_dynamic_objects_, false);
+  node_.param("grid_map/dynamic_obj_margin", mp_.dynamic_obj_margin_, 0.2);
+  node_.param("grid_map/dynamic_obj_as_miss", mp_.dynamic_obj_as_miss_, true);
 
   node_.param("grid_map/p_hit", mp_.p_hit_, 0.70);
   node_.param("grid_map/p_miss", mp_.p_miss_, 0.35);
@@ -38,17 +95,50 @@ void GridMap::initMap(ros::NodeHandle &nh)
   node_.param("grid_map/p_occ", mp_.p_occ_, 0.80);
   node_.param("grid_map/min_ray_length", mp_.min_ray_length_, -0.1);
   node_.param("grid_map/max_ray_length", mp_.max_ray_length_, -0.1);
+  node_.param("grid_map/use_ray_packet", mp_.use_ray_packet_, true);
+  node_.param("grid_map/fusion_threads", mp_.fusion_threads_, 0);
+  node_.param("grid_map/use_projective_fusion", mp_.use_projective_fusion_, false);
+  // off: with the rays merged by endpoint voxel, sorting costs more than the
+  // tracing gains, see test/fusion_benchmark.cpp
+  node_.param("grid_map/sort_rays", mp_.sort_rays_, false);
+  node_.param("grid_map/coarse_ranges", mp_.coarse_ranges_, vector<double>());
+  node_.param("grid_map/pipeline_fusion", mp_.pipeline_fusion_, true);
+  node_.param("grid_map/max_coalesced_frames", mp_.max_coalesced_frames_, 4);
+  mp_.max_coalesced_frames_ = max(min(mp_.max_coalesced_frames_, (int)MAX_COALESCED_FRAMES), 1);
+  // off: the two passes vote slightly differently than one, see
+  // fusePriorityRays(); the SITL launch turns it on for fast flight
+  node_.param("grid_map/velocity_priority", mp_.velocity_priority_, false);
+  node_.param("grid_map/priority_cone_dgr", mp_.priority_cone_, 30.0);
+  node_.param("grid_map/priority_min_speed", mp_.priority_min_speed_, 1.0);
+  node_.param("grid_map/velocity_window", mp_.velocity_window_, 0.1);
+  mp_.priority_cone_ *= M_PI / 180.0;
+  node_.param("grid_map/mapping_cpus", mp_.mapping_cpus_, vector<int>());
+  node_.param("grid_map/alloc_warmup_cycles", mp_.alloc_warmup_cycles_, 50);
+  node_.param("grid_map/abort_on_alloc", mp_.abort_on_alloc_, false);
+  node_.param("grid_map/map_delta_keyframe_interval", mp_.map_delta_keyframe_interval_, 5.0);
+  node_.param("grid_map/map_stream_keyframe_interval", mp_.map_stream_keyframe_interval_, 10.0);
+  node_.param("grid_map/map_stream_compression", mp_.map_stream_compression_, 6);
 
   node_.param("grid_map/visualization_truncate_height", mp_.visualization_truncate_height_, -0.1);
+  node_.param("grid_map/visualization_rate", mp_.visualization_rate_, 9.0);
+  node_.param("grid_map/visualization_threads", mp_.visualization_threads_, 2);
+  mp_.visualization_threads_ = max(mp_.visualization_threads_, 1);
   node_.param("grid_map/virtual_ceil_yp", mp_.virtual_ceil_yp_, -0.1);
   node_.param("grid_map/virtual_ceil_yn", mp_.virtual_ceil_yn_, -0.1);
 
   node_.param("grid_map/show_occ_time", mp_.show_occ_time_, false);
   node_.param("grid_map/pose_type", mp_.pose_type_, 1);
+  node_.param("grid_map/interpolate_odom", mp_.interpolate_odom_, true);
+  node_.param("grid_map/odom_sync_tolerance", mp_.odom_sync_tolerance_, 0.02);
+  node_.param("grid_map/odom_wait_max", mp_.odom_wait_max_, 0.1);
+  node_.param("grid_map/compressed_depth", mp_.compressed_depth_, false);
+  node_.param("grid_map/cloud_fusion", mp_.cloud_fusion_, false);
 
   node_.param("grid_map/frame_id", mp_.frame_id_, string("world"));
   node_.param("grid_map/local_map_margin", mp_.local_map_margin_, 1);
   node_.param("grid_map/ground_height", mp_.ground_height_, 1.0);
+  // a ceiling at or below the ground disables it
+  node_.param("grid_map/virtual_ceil_height", mp_.virtual_ceil_height_, mp_.ground_height_);
 
   node_.param("grid_map/odom_depth_timeout", mp_.odom_depth_timeout_, 1.0);
 
@@ -81,13 +171,68 @@ void GridMap::initMap(ros::NodeHandle &nh)
 
   md_.occupancy_buffer_ = vector<double>(buffer_size, mp_.clamp_min_log_ - mp_.unknown_flag_);
   md_.occupancy_buffer_inflate_ = vector<char>(buffer_size, 0);
+  md_.occupancy_state_ = vector<char>(buffer_size, VOXEL_UNKNOWN);
 
-  md_.count_hit_and_miss_ = vector<short>(buffer_size, 0);
-  md_.count_hit_ = vector<short>(buffer_size, 0);
-  md_.flag_rayend_ = vector<char>(buffer_size, -1);
-  md_.flag_traverse_ = vector<char>(buffer_size, -1);
-
-  md_.raycast_num_ = 0;
+  md_.inflate_versions_.resize(INFLATE_VERSIONS);
+  for (std::unique_ptr<InflateVersion> &version : md_.inflate_versions_)
+  {
+    version.reset(new InflateVersion);
+    version->buffer_ = md_.occupancy_buffer_inflate_;
+    version->state_ = md_.occupancy_state_;
+    // nothing is shown until fusion publishes a local box
+    version->bound_min_ = Eigen::Vector3i::Zero();
+    version->bound_max_ = -Eigen::Vector3i::Ones();
+    version->version_ = 0;
+    version->readers_ = 0;
+    version->owner_ = this;
+  }
+  md_.inflate_current_ = md_.inflate_versions_[0].get();
+  md_.inflate_version_ = 0;
+  md_.inflate_dirty_.resize(INFLATE_HISTORY);
+
+  md_.delta_state_ = vector<char>(buffer_size, 0);
+  md_.delta_dirty_min_ = mp_.map_voxel_num_;
+  md_.delta_dirty_max_ = -Eigen::Vector3i::Ones();
+  md_.delta_dirty_version_ = 0;
+  md_.delta_version_ = md_.stream_version_ = 0;
+  md_.delta_subs_ = md_.stream_subs_ = 0;
+  md_.delta_synced_ = md_.stream_synced_ = false;
+  {
+    const int size[3] = { mp_.map_voxel_num_(0), mp_.map_voxel_num_(1), mp_.map_voxel_num_(2) };
+    md_.stream_brick_listed_ = vector<char>(map_codec::brickCount(size), 0);
+  }
+  md_.stream_bytes_ = 0;
+  md_.map_pub_version_ = md_.map_inf_pub_version_ = 0;
+  md_.map_pub_subs_ = md_.map_inf_pub_subs_ = 0;
+
+  md_.count_votes_ = vector<short>((size_t)buffer_size * mp_.max_coalesced_frames_, 0);
+  md_.count_frames_ = vector<uint8_t>(buffer_size, 0);
+  md_.batch_frame_ = 0;
+
+  // smallest shift that maps every address into RAYCAST_SLABS slabs
+  md_.slab_shift_ = 0;
+  while (((buffer_size - 1) >> md_.slab_shift_) >= RAYCAST_SLABS)
+    md_.slab_shift_++;
+  md_.slab_voxel_.resize(RAYCAST_SLABS);
+
+  if (mp_.fusion_threads_ <= 0)
+    mp_.fusion_threads_ = fusionMaxThreads();
+  // coarse levels need increasing ranges, one address bit is kept per level
+  sort(mp_.coarse_ranges_.begin(), mp_.coarse_ranges_.end());
+  if ((int)mp_.coarse_ranges_.size() > COARSE_MAX_LEVEL)
+    mp_.coarse_ranges_.resize(COARSE_MAX_LEVEL);
+  md_.coarse_voxel_num_.resize(mp_.coarse_ranges_.size() + 1);
+  for (size_t level = 0; level < md_.coarse_voxel_num_.size(); ++level)
+    for (int i = 0; i < 3; ++i)
+      md_.coarse_voxel_num_[level](i) = (mp_.map_voxel_num_(i) + (1 << level) - 1) >> level;
+
+  initRangeImage();
+  if (!mp_.cloud_fusion_)
+    initInflateStencil();
+
+  md_.raycast_workers_.resize(mp_.fusion_threads_);
+  for (RaycastWorker &worker : md_.raycast_workers_)
+    worker.slab_log_.resize(RAYCAST_SLABS);
 
   md_.proj_points_.resize(640 * 480 / mp_.skip_pixel_ / mp_.skip_pixel_);
   md_.proj_points_cnt = 0;
@@ -99,7 +244,15 @@ void GridMap::initMap(ros::NodeHandle &nh)
 
   /* init callback */
 
-  depth_sub_.reset(new message_filters::Subscriber<sensor_msgs::Image>(node_, "grid_map/depth", 50));
+  // compressed images carry no pose to synchronise with
+  if (mp_.compressed_depth_ && !(mp_.pose_type_ == ODOMETRY && mp_.interpolate_odom_))
+  {
+    ROS_WARN("compressed_depth needs pose_type ODOMETRY with interpolate_odom, using raw depth");
+    mp_.compressed_depth_ = false;
+  }
+
+  if (!mp_.compressed_depth_)
+    depth_sub_.reset(new message_filters::Subscriber<sensor_msgs::Image>(node_, "grid_map/depth", 50));
   extrinsic_sub_ = node_.subscribe<nav_msgs::Odometry>(
       "/vins_fusion/extrinsic", 10, &GridMap::extrinsicCallback, this); //sub
 
@@ -112,6 +265,17 @@ void GridMap::initMap(ros::NodeHandle &nh)
         SyncPolicyImagePose(100), *depth_sub_, *pose_sub_));
     sync_image_pose_->registerCallback(boost::bind(&GridMap::depthPoseCallback, this, _1, _2));
   }
+  else if (mp_.pose_type_ == ODOMETRY && mp_.interpolate_odom_)
+  {
+    // images go out as soon as they arrive, odomCallback fills the buffer
+    // their poses are interpolated from
+    if (mp_.compressed_depth_)
+      depth_compressed_sub_ = node_.subscribe<sensor_msgs::CompressedImage>(
+          "grid_map/depth/compressedDepth", 10, &GridMap::depthCompressedCallback, this,
+          ros::TransportHints().tcpNoDelay());
+    else
+      depth_sub_->registerCallback(&GridMap::depthCallback, this);
+  }
   else if (mp_.pose_type_ == ODOMETRY)
   {
     odom_sub_.reset(new message_filters::Subscriber<nav_msgs::Odometry>(node_, "grid_map/odom", 100, ros::TransportHints().tcpNoDelay()));
@@ -124,20 +288,24 @@ void GridMap::initMap(ros::NodeHandle &nh)
   // use odometry and point cloud
   indep_cloud_sub_ =
       node_.subscribe<sensor_msgs::PointCloud2>("grid_map/cloud", 10, &GridMap::cloudCallback, this);
-  indep_odom_sub_ =
-      node_.subscribe<nav_msgs::Odometry>("grid_map/odom", 10, &GridMap::odomCallback, this);
+  indep_odom_sub_ = node_.subscribe<nav_msgs::Odometry>("grid_map/odom", 100, &GridMap::odomCallback, this,
+                                                        ros::TransportHints().tcpNoDelay());
 
-  occ_timer_ = node_.createTimer(ros::Duration(0.05), &GridMap::updateOccupancyCallback, this);
-  vis_timer_ = node_.createTimer(ros::Duration(0.11), &GridMap::visCallback, this);
+  // fusion runs as soon as a frame arrives, the timer only watches for gaps
+  occ_timer_ = node_.createTimer(ros::Duration(0.05), &GridMap::fusionWatchdogCallback, this);
 
   map_pub_ = node_.advertise<sensor_msgs::PointCloud2>("grid_map/occupancy", 10);
   map_inf_pub_ = node_.advertise<sensor_msgs::PointCloud2>("grid_map/occupancy_inflate", 10);
+  map_delta_pub_ = node_.advertise<plan_env::MapDelta>("grid_map/occupancy_delta", 10);
+  map_stream_pub_ = node_.advertise<plan_env::MapChunk>("grid_map/occupancy_stream", 10);
 
-  md_.occ_need_update_ = false;
   md_.local_updated_ = false;
+  md_.occupied_max_ = 0;
+  md_.warm_allocs_ = 0;
   md_.has_first_depth_ = false;
   md_.has_odom_ = false;
   md_.has_cloud_ = false;
+  md_.odom_pos_ = Eigen::Vector3d::Zero();
   md_.image_cnt_ = 0;
   md_.last_occ_update_time_.fromSec(0);
 
@@ -148,21 +316,30 @@ void GridMap::initMap(ros::NodeHandle &nh)
   md_.flag_depth_odom_timeout_ = false;
   md_.flag_use_depth_fusion = false;
 
+  startFusionThreads();
+
+  vis_stop_ = false;
+  if (mp_.visualization_rate_ > 0)
+    vis_thread_ = std::thread(&GridMap::visualizationLoop, this);
+
   // rand_noise_ = uniform_real_distribution<double>(-0.2, 0.2);
   // rand_noise2_ = normal_distribution<double>(0, 0.2);
   // random_device rd;
   // eng_ = default_random_engine(rd());
 }
 
+GridMap::~GridMap()
+{
+  stopVisualization();
+  stopFusionThreads();
+}
+
 void GridMap::resetBuffer()
 {
   Eigen::Vector3d min_pos = mp_.map_min_boundary_;
   Eigen::Vector3d max_pos = mp_.map_max_boundary_;
 
   resetBuffer(min_pos, max_pos);
-
-  md_.local_bound_min_ = Eigen::Vector3i::Zero();
-  md_.local_bound_max_ = mp_.map_voxel_num_ - Eigen::Vector3i::Ones();
 }
 
 void GridMap::resetBuffer(Eigen::Vector3d min_pos, Eigen::Vector3d max_pos)
@@ -175,6 +352,58 @@ void GridMap::resetBuffer(Eigen::Vector3d min_pos, Eigen::Vector3d max_pos)
   boundIndex(min_id);
   boundIndex(max_id);
 
+  std::lock_guard<std::mutex> lock(inflate_mutex_);
+
+  // the cloud map forgets the voxels of the box, with their share of the
+  // inflation around it, and the counts inside it; a box on the map border
+  // takes the voxels beyond the border too
+  Eigen::Vector3i dirty_min = min_id, dirty_max = max_id;
+  if (!md_.inflate_stencil_id_.empty())
+  {
+    const Eigen::Vector3i reach = md_.inflate_stencil_id_.back();
+    Eigen::Vector3i cut_min = min_id, cut_max = max_id, id;
+    for (int i = 0; i < 3; ++i)
+    {
+      if (cut_min(i) == 0)
+        cut_min(i) = -reach(i);
+      if (cut_max(i) == mp_.map_voxel_num_(i) - 1)
+        cut_max(i) += reach(i);
+    }
+
+    size_t kept = 0;
+    for (int adr : md_.cloud_occ_)
+    {
+      cloudIndex(adr, id);
+      if ((id.array() >= cut_min.array()).all() && (id.array() <= cut_max.array()).all())
+        inflateCloudVoxel(adr, -1);
+      else
+        md_.cloud_occ_[kept++] = adr;
+    }
+    md_.cloud_occ_.resize(kept);
+
+    for (int x = min_id(0); x <= max_id(0); ++x)
+      for (int y = min_id(1); y <= max_id(1); ++y)
+        for (int z = min_id(2); z <= max_id(2); ++z)
+          md_.cloud_inflate_refs_[toAddress(x, y, z)] = 0;
+
+    dirty_min -= reach;
+    dirty_max += reach;
+  }
+  clearInflation(min_id, max_id);
+
+  // the shown box takes in the cleared one, so its clouds are sent again
+  const InflateVersion *current = md_.inflate_current_.load();
+  Eigen::Vector3i bound_min = min_id, bound_max = max_id;
+  if ((current->bound_min_.array() <= current->bound_max_.array()).all())
+  {
+    bound_min = bound_min.cwiseMin(current->bound_min_);
+    bound_max = bound_max.cwiseMax(current->bound_max_);
+  }
+  publishInflateVersion(dirty_min, dirty_max, bound_min, bound_max);
+}
+
+void GridMap::clearInflation(const Eigen::Vector3i &min_id, const Eigen::Vector3i &max_id)
+{
   /* reset occ and dist buffer */
   for (int x = min_id(0); x <= max_id(0); ++x)
     for (int y = min_id(1); y <= max_id(1); ++y)
@@ -184,48 +413,378 @@ void GridMap::resetBuffer(Eigen::Vector3d min_pos, Eigen::Vector3d max_pos)
       }
 }
 
-int GridMap::setCacheOccupancy(Eigen::Vector3d pos, int occ)
+// (2s+1)^2 x 3 offsets of a point's inflation, as indices and as address
+// offsets for voxels far enough from the map border
+void GridMap::initInflateStencil()
+{
+  const int inf_step = ceil(mp_.obstacles_inflation_ / mp_.resolution_);
+  const int inf_step_z = 1;
+
+  md_.inflate_stencil_.clear();
+  md_.inflate_stencil_id_.clear();
+  for (int x = -inf_step; x <= inf_step; ++x)
+    for (int y = -inf_step; y <= inf_step; ++y)
+      for (int z = -inf_step_z; z <= inf_step_z; ++z)
+      {
+        md_.inflate_stencil_id_.push_back(Eigen::Vector3i(x, y, z));
+        md_.inflate_stencil_.push_back(toAddress(x, y, z));
+      }
+
+  md_.cloud_inflate_refs_ = vector<uint16_t>(md_.occupancy_buffer_inflate_.size(), 0);
+  md_.cloud_occ_.clear();
+}
+
+// add (delta > 0) or remove one occupied voxel's share of its inflation,
+// clipped to the map; adr is a cloud map address
+void GridMap::inflateCloudVoxel(int adr, int delta)
+{
+  const Eigen::Vector3i reach = md_.inflate_stencil_id_.back();
+  Eigen::Vector3i id;
+  cloudIndex(adr, id);
+  const bool inner = (id.array() >= reach.array()).all() &&
+                     (id.array() < (mp_.map_voxel_num_ - reach).array()).all();
+  const int map_adr = inner ? toAddress(id) : 0;
+
+  for (size_t k = 0; k < md_.inflate_stencil_.size(); ++k)
+  {
+    int inf_adr = map_adr + md_.inflate_stencil_[k];
+    if (!inner)
+    {
+      Eigen::Vector3i inf_id = id + md_.inflate_stencil_id_[k];
+      if (!isInMap(inf_id))
+        continue;
+      inf_adr = toAddress(inf_id);
+    }
+
+    uint16_t &refs = md_.cloud_inflate_refs_[inf_adr];
+    if (delta > 0)
+    {
+      if (refs++ == 0)
+        md_.occupancy_buffer_inflate_[inf_adr] = 1;
+    }
+    else if (refs > 0 && --refs == 0)
+      md_.occupancy_buffer_inflate_[inf_adr] = 0;
+  }
+}
+
+GridMap::VersionPin GridMap::pinVersion()
+{
+  VersionPin pin;
+  InflateVersion *version;
+  do
+  {
+    // the writer may recycle the copy between the load and the increment,
+    // it counts only once it is still current afterwards
+    version = md_.inflate_current_.load();
+    version->readers_.fetch_add(1);
+    if (md_.inflate_current_.load() == version)
+      break;
+    version->readers_.fetch_sub(1);
+  } while (true);
+
+  pin.version_ = version;
+  pin.previous_ = pinned_inflate_;
+  pinned_inflate_ = version;
+  return pin;
+}
+
+GridMap::VersionPin::~VersionPin()
+{
+  if (!version_)
+    return;
+  if (pinned_inflate_ == version_)
+    pinned_inflate_ = previous_;
+  version_->readers_.fetch_sub(1);
+}
+
+void GridMap::setOccupied(Eigen::Vector3d pos)
+{
+  if (!isInMap(pos))
+    return;
+
+  Eigen::Vector3i id;
+  posToIndex(pos, id);
+
+  std::lock_guard<std::mutex> lock(inflate_mutex_);
+  md_.occupancy_buffer_inflate_[toAddress(id)] = 1;
+  publishInflateVoxel(id);
+}
+
+void GridMap::setOccupancy(Eigen::Vector3d pos, double occ)
 {
   if (occ != 1 && occ != 0)
-    return INVALID_IDX;
+  {
+    cout << "occ value error!" << endl;
+    return;
+  }
+
+  if (!isInMap(pos))
+    return;
 
   Eigen::Vector3i id;
   posToIndex(pos, id);
-  int idx_ctns = toAddress(id);
+  const int adr = toAddress(id);
+  md_.occupancy_buffer_[adr] = occ;
+
+  // the state fusion would publish for these log-odds
+  std::lock_guard<std::mutex> lock(inflate_mutex_);
+  md_.occupancy_state_[adr] =
+      occ < mp_.clamp_min_log_ - 1e-3 ? VOXEL_UNKNOWN : occ > mp_.min_occupancy_log_ ? VOXEL_OCCUPIED : VOXEL_FREE;
+  publishInflateVoxel(id);
+}
+
+void GridMap::publishInflateVoxel(const Eigen::Vector3i &id)
+{
+  // the shown box takes in the voxel, as for a reset
+  const InflateVersion *current = md_.inflate_current_.load();
+  Eigen::Vector3i bound_min = id, bound_max = id;
+  if ((current->bound_min_.array() <= current->bound_max_.array()).all())
+  {
+    bound_min = bound_min.cwiseMin(current->bound_min_);
+    bound_max = bound_max.cwiseMax(current->bound_max_);
+  }
+  publishInflateVersion(id, id, bound_min, bound_max);
+}
+
+void GridMap::copyInflateBox(InflateVersion &dst, const Eigen::Vector3i &min_id, const Eigen::Vector3i &max_id)
+{
+  int z = min_id(2);
+  const int len = max_id(2) - z + 1;
+  for (int x = min_id(0); x <= max_id(0); ++x)
+    for (int y = min_id(1); y <= max_id(1); ++y)
+    {
+      int adr = toAddress(x, y, z);
+      memcpy(&dst.buffer_[adr], &md_.occupancy_buffer_inflate_[adr], len);
+      memcpy(&dst.state_[adr], &md_.occupancy_state_[adr], len);
+    }
+}
+
+void GridMap::publishInflateVersion(Eigen::Vector3i min_id, Eigen::Vector3i max_id, const Eigen::Vector3i &bound_min,
+                                    const Eigen::Vector3i &bound_max)
+{
+  boundIndex(min_id);
+  boundIndex(max_id);
+
+  const uint64_t version = ++md_.inflate_version_;
+  md_.inflate_dirty_[version % INFLATE_HISTORY] = std::make_pair(min_id, max_id);
 
-  md_.count_hit_and_miss_[idx_ctns] += 1;
+  // the most recent copy that no reader holds needs the least catching up
+  InflateVersion *current = md_.inflate_current_.load();
+  InflateVersion *next = nullptr;
+  for (std::unique_ptr<InflateVersion> &candidate : md_.inflate_versions_)
+    if (candidate.get() != current && candidate->readers_.load() == 0 &&
+        (!next || candidate->version_ > next->version_))
+      next = candidate.get();
 
-  if (md_.count_hit_and_miss_[idx_ctns] == 1)
+  if (!next)
+  {
+    // every copy is pinned, add one rather than wait for a reader
+    md_.inflate_versions_.emplace_back(new InflateVersion);
+    next = md_.inflate_versions_.back().get();
+    next->buffer_ = md_.occupancy_buffer_inflate_;
+    next->state_ = md_.occupancy_state_;
+    next->readers_ = 0;
+    next->owner_ = this;
+  }
+  else if (version - next->version_ > INFLATE_HISTORY)
   {
-    md_.cache_voxel_.push(id);
+    next->buffer_ = md_.occupancy_buffer_inflate_;
+    next->state_ = md_.occupancy_state_;
+  }
+  else
+  {
+    for (uint64_t v = next->version_ + 1; v <= version; ++v)
+    {
+      const std::pair<Eigen::Vector3i, Eigen::Vector3i> &box = md_.inflate_dirty_[v % INFLATE_HISTORY];
+      copyInflateBox(*next, box.first, box.second);
+    }
   }
 
-  if (occ == 1)
-    md_.count_hit_[idx_ctns] += 1;
+  next->version_ = version;
+  next->bound_min_ = bound_min;
+  next->bound_max_ = bound_max;
+
+  // stored together with the box, so a delta that takes the box under the
+  // same lock pins exactly the version the box was grown for
+  std::lock_guard<std::mutex> lock(delta_mutex_);
+  md_.inflate_current_.store(next);
+  md_.delta_dirty_min_ = md_.delta_dirty_min_.cwiseMin(min_id);
+  md_.delta_dirty_max_ = md_.delta_dirty_max_.cwiseMax(max_id);
+  md_.delta_dirty_version_ = version;
+}
 
-  return idx_ctns;
+void GridMap::projectFrame(DepthFrame &frame)
+{
+  if (frame.cloud_ && mp_.lidar_vtc_line_num_ > 0)
+  {
+    buildRangeImage(frame);
+    if (!mp_.use_projective_fusion_)
+      projectRangeImage(frame);
+  }
+  else if (frame.cloud_)
+    projectCloud(frame);
+  else if (!mp_.use_projective_fusion_)
+    projectDepthImage(frame);
 }
 
-void GridMap::projectDepthImage()
+// Beams lie on a regular azimuth / elevation grid: vtc_line_num rows over
+// the vertical field of view, and hrz_line_num columns per full turn, which
+// wrap around when the scan covers 360 degrees.
+void GridMap::initRangeImage()
 {
-  // md_.proj_points_.clear();
-  md_.proj_points_cnt = 0;
+  md_.lidar_scan_cnt_ = 0;
+  if (mp_.lidar_vtc_line_num_ <= 0)
+    return;
+
+  md_.range_rows_ = mp_.lidar_vtc_line_num_;
+  md_.range_vtc_res_ = md_.range_rows_ > 1 ? mp_.lidar_vtc_range_ / (md_.range_rows_ - 1) : 1.0;
+  md_.range_el0_ = -0.5 * mp_.lidar_vtc_range_;
+
+  md_.range_hrz_res_ = 2 * M_PI / max(mp_.lidar_hrz_line_num_, 1);
+  md_.range_wrap_ = mp_.lidar_hrz_range_ >= 2 * M_PI - 1e-6;
+  if (md_.range_wrap_)
+  {
+    md_.range_cols_ = max(mp_.lidar_hrz_line_num_, 1);
+    md_.range_az0_ = -M_PI;
+  }
+  else
+  {
+    md_.range_cols_ = (int)lround(mp_.lidar_hrz_range_ / md_.range_hrz_res_) + 1;
+    md_.range_az0_ = -0.5 * mp_.lidar_hrz_range_;
+  }
+
+  // every pooled block is projected along the beam through its centre
+  const int pool = mp_.lidar_pool_;
+  const int rows = (md_.range_rows_ + pool - 1) / pool, cols = (md_.range_cols_ + pool - 1) / pool;
+  md_.beam_dir_.resize(rows * cols);
+  for (int r = 0; r < rows; ++r)
+    for (int c = 0; c < cols; ++c)
+    {
+      double row = 0.5 * (r * pool + min((r + 1) * pool, md_.range_rows_) - 1);
+      double col = 0.5 * (c * pool + min((c + 1) * pool, md_.range_cols_) - 1);
+      double el = md_.range_el0_ + row * md_.range_vtc_res_;
+      double az = md_.range_az0_ + col * md_.range_hrz_res_;
+      md_.beam_dir_[r * cols + c] = Eigen::Vector3d(cos(el) * cos(az), cos(el) * sin(az), sin(el));
+    }
+}
+
+// closest return of every beam, in depth units so the depth kernels apply
+void GridMap::buildRangeImage(DepthFrame &frame)
+{
+  frame.depth_.create(md_.range_rows_, md_.range_cols_, CV_16UC1);
+  for (int r = 0; r < md_.range_rows_; ++r)
+    memset(frame.depth_.ptr<uint16_t>(r), 0, md_.range_cols_ * sizeof(uint16_t));
+  frame.range_image_ = true;
+
+  const sensor_msgs::PointCloud2 &cloud = *frame.cloud_;
+  const int num = cloud.width * cloud.height;
+  if (num <= 0)
+    return;
+
+  const Eigen::Matrix3d r_inv = frame.camera_r_m_.transpose();
+  const double max_raw = 65535.0 / mp_.k_depth_scaling_factor_;
+
+  sensor_msgs::PointCloud2ConstIterator<float> it_x(cloud, "x"), it_y(cloud, "y"), it_z(cloud, "z");
+  for (int i = 0; i < num; ++i, ++it_x, ++it_y, ++it_z)
+  {
+    if (!std::isfinite(*it_x) || !std::isfinite(*it_y) || !std::isfinite(*it_z))
+      continue;
+
+    Eigen::Vector3d pt = r_inv * (Eigen::Vector3d(*it_x, *it_y, *it_z) - frame.camera_pos_);
+    double range = pt.norm();
+    int row, col;
+    if (range < 1e-3 || range >= max_raw || !rangeImageCell(pt, range, row, col))
+      continue;
+
+    uint16_t raw = max((uint16_t)1, (uint16_t)(range * mp_.k_depth_scaling_factor_));
+    uint16_t &cell = frame.depth_.ptr<uint16_t>(row)[col];
+    if (cell == 0 || raw < cell)
+      cell = raw;
+  }
+}
+
+// back-project the pooled range image along the beam directions
+void GridMap::projectRangeImage(DepthFrame &frame)
+{
+  minPoolDepth(frame.depth_, 0, mp_.lidar_pool_, 1, md_.range_pool_);
+
+  const int num = md_.range_pool_.rows * md_.range_pool_.cols;
+  frame.proj_points_cnt_ = 0;
+  if ((int)frame.proj_points_.size() < num)
+    frame.proj_points_.resize(num);
+
+  const Eigen::Matrix3d &body_r = frame.camera_r_m_;
+  const double inv_factor = 1.0 / mp_.k_depth_scaling_factor_;
+
+  for (int r = 0; r < md_.range_pool_.rows; ++r)
+  {
+    const uint16_t *row_ptr = md_.range_pool_.ptr<uint16_t>(r);
+    const Eigen::Vector3d *dir = &md_.beam_dir_[r * md_.range_pool_.cols];
+
+    for (int c = 0; c < md_.range_pool_.cols; ++c)
+    {
+      double range = row_ptr[c] * inv_factor;
+      if (row_ptr[c] == 0)
+      {
+        if (!mp_.lidar_no_return_free_)
+          continue;
+        range = mp_.max_ray_length_ + 0.1;
+      }
+      frame.proj_points_[frame.proj_points_cnt_++] = body_r * (dir[c] * range) + frame.camera_pos_;
+    }
+  }
+}
+
+// clouds are already in the world frame, only invalid returns are dropped;
+// range limits and clipping are left to raycastProcess as for depth
+void GridMap::projectCloud(DepthFrame &frame)
+{
+  const sensor_msgs::PointCloud2 &cloud = *frame.cloud_;
+  const int num = cloud.width * cloud.height;
+
+  frame.proj_points_cnt_ = 0;
+  if ((int)frame.proj_points_.size() < num)
+    frame.proj_points_.resize(num);
+
+  if (num > 0)
+  {
+    sensor_msgs::PointCloud2ConstIterator<float> it_x(cloud, "x"), it_y(cloud, "y"), it_z(cloud, "z");
+    for (int i = 0; i < num; ++i, ++it_x, ++it_y, ++it_z)
+    {
+      if (!std::isfinite(*it_x) || !std::isfinite(*it_y) || !std::isfinite(*it_z))
+        continue;
+      frame.proj_points_[frame.proj_points_cnt_++] = Eigen::Vector3d(*it_x, *it_y, *it_z);
+    }
+  }
+}
+
+void GridMap::projectDepthImage(DepthFrame &frame)
+{
+  frame.proj_points_cnt_ = 0;
 
   uint16_t *row_ptr;
   // int cols = current_img_.cols, rows = current_img_.rows;
-  int cols = md_.depth_image_.cols;
-  int rows = md_.depth_image_.rows;
+  int cols = frame.depth_.cols;
+  int rows = frame.depth_.rows;
   int skip_pix = mp_.skip_pixel_;
 
+  int max_points = ((rows + skip_pix - 1) / skip_pix) * ((cols + skip_pix - 1) / skip_pix);
+  if ((int)frame.proj_points_.size() < max_points)
+    frame.proj_points_.resize(max_points);
+
   double depth;
 
-  Eigen::Matrix3d camera_r = md_.camera_r_m_;
+  Eigen::Matrix3d camera_r = frame.camera_r_m_;
 
-  if (!mp_.use_depth_filter_)
+  if (mp_.use_min_pool_)
+  {
+    projectPooledDepth(frame);
+  }
+  else if (!mp_.use_depth_filter_)
   {
     for (int v = 0; v < rows; v+=skip_pix)
     {
-      row_ptr = md_.depth_image_.ptr<uint16_t>(v);
+      row_ptr = frame.depth_.ptr<uint16_t>(v);
 
       for (int u = 0; u < cols; u+=skip_pix)
       {
@@ -236,11 +795,11 @@ void GridMap::projectDepthImage()
         proj_pt(1) = (v - mp_.cy_) * depth / mp_.fy_;
         proj_pt(2) = depth;
 
-        proj_pt = camera_r * proj_pt + md_.camera_pos_;
+        proj_pt = camera_r * proj_pt + frame.camera_pos_;
 
         if (u == 320 && v == 240)
           std::cout << "depth: " << depth << std::endl;
-        md_.proj_points_[md_.proj_points_cnt++] = proj_pt;
+        frame.proj_points_[frame.proj_points_cnt_++] = proj_pt;
       }
     }
   }
@@ -260,7 +819,7 @@ void GridMap::projectDepthImage()
 
       for (int v = mp_.depth_filter_margin_; v < rows - mp_.depth_filter_margin_; v += mp_.skip_pixel_)
       {
-        row_ptr = md_.depth_image_.ptr<uint16_t>(v) + mp_.depth_filter_margin_;
+        row_ptr = frame.depth_.ptr<uint16_t>(v) + mp_.depth_filter_margin_;
 
         for (int u = mp_.depth_filter_margin_; u < cols - mp_.depth_filter_margin_;
              u += mp_.skip_pixel_)
@@ -291,12 +850,12 @@ void GridMap::projectDepthImage()
           pt_cur(1) = (v - mp_.cy_) * depth / mp_.fy_;
           pt_cur(2) = depth;
 
-          pt_world = camera_r * pt_cur + md_.camera_pos_;
+          pt_world = camera_r * pt_cur + frame.camera_pos_;
           // if (!isInMap(pt_world)) {
-          //   pt_world = closetPointInMap(pt_world, md_.camera_pos_);
+          //   pt_world = closetPointInMap(pt_world, frame.camera_pos_);
           // }
 
-          md_.proj_points_[md_.proj_points_cnt++] = pt_world;
+          frame.proj_points_[frame.proj_points_cnt_++] = pt_world;
 
           // check consistency with last image, disabled...
           if (false)
@@ -310,12 +869,12 @@ void GridMap::projectDepthImage()
               if (fabs(md_.last_depth_image_.at<uint16_t>((int)vv, (int)uu) * inv_factor -
                        pt_reproj.z()) < mp_.depth_filter_tolerance_)
               {
-                md_.proj_points_[md_.proj_points_cnt++] = pt_world;
+                frame.proj_points_[frame.proj_points_cnt_++] = pt_world;
               }
             }
             else
             {
-              md_.proj_points_[md_.proj_points_cnt++] = pt_world;
+              frame.proj_points_[frame.proj_points_cnt_++] = pt_world;
             }
           }
         }
@@ -325,209 +884,787 @@ void GridMap::projectDepthImage()
 
   /* maintain camera pose for consistency check */
 
-  md_.last_camera_pos_ = md_.camera_pos_;
-  md_.last_camera_r_m_ = md_.camera_r_m_;
-  md_.last_depth_image_ = md_.depth_image_;
+  md_.last_camera_pos_ = frame.camera_pos_;
+  md_.last_camera_r_m_ = frame.camera_r_m_;
+  md_.last_depth_image_ = frame.depth_;
 }
 
-void GridMap::raycastProcess()
+void GridMap::projectPooledDepth(DepthFrame &frame)
 {
-  // if (md_.proj_points_.size() == 0)
-  if (md_.proj_points_cnt == 0)
-    return;
-
-  ros::Time t1, t2;
-
-  md_.raycast_num_ += 1;
+  const int skip_pix = max(mp_.skip_pixel_, 1);
+  const int margin = mp_.use_depth_filter_ ? mp_.depth_filter_margin_ : 0;
 
-  int vox_idx;
-  double length;
+  if (mp_.use_depth_filter_ && !md_.has_first_depth_)
+  {
+    md_.has_first_depth_ = true;
+    return;
+  }
 
-  // bounding box of updated region
-  double min_x = mp_.map_max_boundary_(0);
-  double min_y = mp_.map_max_boundary_(1);
-  double min_z = mp_.map_max_boundary_(2);
+  minPoolDepth(frame.depth_, margin, skip_pix, mp_.pool_min_raw_, md_.depth_pool_);
 
-  double max_x = mp_.map_min_boundary_(0);
-  double max_y = mp_.map_min_boundary_(1);
-  double max_z = mp_.map_min_boundary_(2);
+  int pool_size = md_.depth_pool_.rows * md_.depth_pool_.cols;
+  if ((int)frame.proj_points_.size() < pool_size)
+    frame.proj_points_.resize(pool_size);
 
-  RayCaster raycaster;
-  Eigen::Vector3d half = Eigen::Vector3d(0.5, 0.5, 0.5);
-  Eigen::Vector3d ray_pt, pt_w;
+  const Eigen::Matrix3d &camera_r = frame.camera_r_m_;
+  const double inv_factor = 1.0 / mp_.k_depth_scaling_factor_;
+  // project each block from its centre pixel
+  const double offset = margin + 0.5 * (skip_pix - 1);
+  Eigen::Vector3d pt_cur;
+  double depth;
 
-  for (int i = 0; i < md_.proj_points_cnt; ++i)
+  for (int r = 0; r < md_.depth_pool_.rows; ++r)
   {
-    pt_w = md_.proj_points_[i];
-
-    // set flag for projected point
+    const uint16_t *row_ptr = md_.depth_pool_.ptr<uint16_t>(r);
+    double v = offset + r * skip_pix;
 
-    if (!isInMap(pt_w))
+    for (int c = 0; c < md_.depth_pool_.cols; ++c)
     {
-      pt_w = closetPointInMap(pt_w, md_.camera_pos_);
+      double u = offset + c * skip_pix;
+      depth = row_ptr[c] * inv_factor;
 
-      length = (pt_w - md_.camera_pos_).norm();
-      if (length > mp_.max_ray_length_)
+      if (mp_.use_depth_filter_)
       {
-        pt_w = (pt_w - md_.camera_pos_) / length * mp_.max_ray_length_ + md_.camera_pos_;
+        if (row_ptr[c] == 0 || depth > mp_.depth_filter_maxdist_)
+          depth = mp_.max_ray_length_ + 0.1;
+        else if (depth < mp_.depth_filter_mindist_)
+          continue;
       }
-      vox_idx = setCacheOccupancy(pt_w, 0);
-    }
-    else
-    {
-      length = (pt_w - md_.camera_pos_).norm();
 
-      if (length > mp_.max_ray_length_)
-      {
-        pt_w = (pt_w - md_.camera_pos_) / length * mp_.max_ray_length_ + md_.camera_pos_;
-        vox_idx = setCacheOccupancy(pt_w, 0);
-      }
-      else
-      {
-        vox_idx = setCacheOccupancy(pt_w, 1);
-      }
+      pt_cur(0) = (u - mp_.cx_) * depth / mp_.fx_;
+      pt_cur(1) = (v - mp_.cy_) * depth / mp_.fy_;
+      pt_cur(2) = depth;
+
+      frame.proj_points_[frame.proj_points_cnt_++] = camera_r * pt_cur + frame.camera_pos_;
     }
+  }
+}
 
-    max_x = max(max_x, pt_w(0));
-    max_y = max(max_y, pt_w(1));
-    max_z = max(max_z, pt_w(2));
+void GridMap::collectRayEnds(const Eigen::Vector3i &cam_id)
+{
+  md_.ray_ends_.clear();
+  md_.ray_end_map_.clear();
 
-    min_x = min(min_x, pt_w(0));
-    min_y = min(min_y, pt_w(1));
-    min_z = min(min_z, pt_w(2));
+  double length, t_in, t_out;
+  Eigen::Vector3d pt_w, ray;
+  Eigen::Vector3i pt_id;
+  Eigen::Vector3d bound_min = md_.camera_pos_, bound_max = md_.camera_pos_;
+  bool inserted;
 
-    // raycasting between camera center and point
+  for (int i = 0; i < md_.proj_points_cnt; ++i)
+  {
+    ray = md_.proj_points_[i] - md_.camera_pos_;
+    length = ray.norm();
+    if (length < 1e-6)
+      continue;
 
-    if (vox_idx != INVALID_IDX)
-    {
-      if (md_.flag_rayend_[vox_idx] == md_.raycast_num_)
-      {
-        continue;
-      }
-      else
-      {
-        md_.flag_rayend_[vox_idx] = md_.raycast_num_;
-      }
-    }
+    // slab test of the segment against the clip box and the maximum range;
+    // a ray that leaves them ends just inside as a miss, and one that starts
+    // outside is only walked from where it enters
 
-    raycaster.setInput(pt_w / mp_.resolution_, md_.camera_pos_ / mp_.resolution_);
+    t_in = 0.0;
+    t_out = min(1.0, mp_.max_ray_length_ / length);
+    if (!clipRay(ray, t_in, t_out))
+      continue;
 
-    while (raycaster.step(ray_pt))
-    {
-      Eigen::Vector3d tmp = (ray_pt + half) * mp_.resolution_;
-      length = (tmp - md_.camera_pos_).norm();
+    // keep clipped ends a thousandth of a voxel off the box faces
+    const double t_eps = 1e-3 * mp_.resolution_ / length;
+    const bool occ = t_out >= 1.0;
 
-      // if (length < mp_.min_ray_length_) break;
+    // a return from a tracked object is no static structure
+    const bool dynamic = occ && inObjBox(md_.proj_points_[i]);
+    if (dynamic && !mp_.dynamic_obj_as_miss_)
+      continue;
 
-      vox_idx = setCacheOccupancy(tmp, 0);
+    pt_w = occ ? md_.proj_points_[i] : Eigen::Vector3d(md_.camera_pos_ + (t_out - t_eps) * ray);
+    posToIndex(pt_w, pt_id);
+    if (!isInClipBox(pt_id))
+      continue;
 
-      if (vox_idx != INVALID_IDX)
+    int &end_idx = md_.ray_end_map_.insert(toAddress(pt_id), inserted);
+    if (inserted)
+    {
+      // the first ray into a voxel is the one traced for all of them
+      end_idx = md_.ray_ends_.size();
+      md_.ray_ends_.emplace_back();
+      RayEnd &end = md_.ray_ends_.back();
+      end.adr = toAddress(pt_id);
+      end.id = pt_id;
+      end.hit = end.miss = 0;
+      end.dir = ray / length;
+      end.near = t_in * length;
+      end.far = occ ? length : t_out * length;
+      if (t_in > 0.0)
       {
-        if (md_.flag_traverse_[vox_idx] == md_.raycast_num_)
-        {
-          break;
-        }
-        else
-        {
-          md_.flag_traverse_[vox_idx] = md_.raycast_num_;
-        }
+        // a clipped ray stops where it enters, like one from the camera
+        // stops at the camera voxel; rounding must not put it outside
+        posToIndex(Eigen::Vector3d(md_.camera_pos_ + (t_in + t_eps) * ray), end.start_id);
+        end.start_id = end.start_id.cwiseMax(md_.ray_clip_min_id_).cwiseMin(md_.ray_clip_max_id_);
       }
-    }
-  }
-
-  min_x = min(min_x, md_.camera_pos_(0));
-  min_y = min(min_y, md_.camera_pos_(1));
-  min_z = min(min_z, md_.camera_pos_(2));
+      else
+        end.start_id = cam_id;
 
-  max_x = max(max_x, md_.camera_pos_(0));
-  max_y = max(max_y, md_.camera_pos_(1));
-  max_z = max(max_z, md_.camera_pos_(2));
-  max_z = max(max_z, mp_.ground_height_);
+      bound_max = bound_max.cwiseMax(pt_w);
+      bound_min = bound_min.cwiseMin(pt_w);
+    }
 
-  posToIndex(Eigen::Vector3d(max_x, max_y, max_z), md_.local_bound_max_);
-  posToIndex(Eigen::Vector3d(min_x, min_y, min_z), md_.local_bound_min_);
-  boundIndex(md_.local_bound_min_);
-  boundIndex(md_.local_bound_max_);
+    RayEnd &end = md_.ray_ends_[end_idx];
+    if (occ && !dynamic)
+      end.hit++;
+    else
+      end.miss++;
+  }
 
-  md_.local_updated_ = true;
+  // endpoint counters go straight to their slabs, traversal misses are
+  // merged on top of them
+  for (const RayEnd &end : md_.ray_ends_)
+  {
+    if (md_.count_frames_[end.adr] == 0)
+      md_.slab_voxel_[end.adr >> md_.slab_shift_].push_back(end.adr);
+    md_.count_frames_[end.adr] |= 1 << md_.batch_frame_;
+    md_.count_votes_[(size_t)end.adr * mp_.max_coalesced_frames_ + md_.batch_frame_] += end.hit - end.miss;
+  }
 
-  // update occupancy cached in queue
-  Eigen::Vector3d local_range_min = md_.camera_pos_ - mp_.local_update_range_;
-  Eigen::Vector3d local_range_max = md_.camera_pos_ + mp_.local_update_range_;
+  // bounding box of updated region
+  bound_max(2) = max(bound_max(2), mp_.ground_height_);
 
   Eigen::Vector3i min_id, max_id;
-  posToIndex(local_range_min, min_id);
-  posToIndex(local_range_max, max_id);
+  posToIndex(bound_max, max_id);
+  posToIndex(bound_min, min_id);
   boundIndex(min_id);
   boundIndex(max_id);
+  expandLocalBound(min_id, max_id);
+}
 
-  // std::cout << "cache all: " << md_.cache_voxel_.size() << std::endl;
-
-  while (!md_.cache_voxel_.empty())
-  {
-
-    Eigen::Vector3i idx = md_.cache_voxel_.front();
-    int idx_ctns = toAddress(idx);
-    md_.cache_voxel_.pop();
+void GridMap::setObjPrediction(fast_planner::ObjPrediction prediction, fast_planner::ObjScale scale)
+{
+  // the predictor keeps updating its own vectors
+  fast_planner::ObjPrediction predictions;
+  if (prediction && scale)
+    predictions = std::make_shared<vector<fast_planner::PolynomialPrediction>>(*prediction);
+
+  std::lock_guard<std::mutex> lock(obj_mutex_);
+  obj_predictions_ = predictions;
+  obj_scales_.clear();
+  if (predictions)
+    obj_scales_ = *scale;
+}
 
-    double log_odds_update =
-        md_.count_hit_[idx_ctns] >= md_.count_hit_and_miss_[idx_ctns] - md_.count_hit_[idx_ctns] ? mp_.prob_hit_log_ : mp_.prob_miss_log_;
+// boxes of the tracked objects at the frame stamp, from their constant
+// velocity prediction grown by dynamic_obj_margin_
+void GridMap::updateObjBoxes(const ros::Time &stamp)
+{
+  md_.obj_box_min_.clear();
+  md_.obj_box_max_.clear();
+  if (!mp_.mask_dynamic_objects_)
+    return;
 
-    md_.count_hit_[idx_ctns] = md_.count_hit_and_miss_[idx_ctns] = 0;
+  std::lock_guard<std::mutex> lock(obj_mutex_);
+  if (!obj_predictions_)
+    return;
+  vector<fast_planner::PolynomialPrediction> &predictions = *obj_predictions_;
+  const size_t obj_num = min(predictions.size(), obj_scales_.size());
+  for (size_t i = 0; i < obj_num; ++i)
+  {
+    if (!predictions[i].valid())
+      continue;
 
-    if (log_odds_update >= 0 && md_.occupancy_buffer_[idx_ctns] >= mp_.clamp_max_log_)
-    {
+    Eigen::Vector3d center = predictions[i].evaluateConstVel(stamp.toSec());
+    Eigen::Vector3d half = 0.5 * obj_scales_[i] + Eigen::Vector3d::Constant(mp_.dynamic_obj_margin_);
+    if (!center.allFinite())
       continue;
-    }
-    else if (log_odds_update <= 0 && md_.occupancy_buffer_[idx_ctns] <= mp_.clamp_min_log_)
+
+    md_.obj_box_min_.push_back(center - half);
+    md_.obj_box_max_.push_back(center + half);
+    if (md_.obj_box_min_.size() == 1)
     {
-      md_.occupancy_buffer_[idx_ctns] = mp_.clamp_min_log_;
-      continue;
+      md_.obj_bound_min_ = md_.obj_box_min_.back();
+      md_.obj_bound_max_ = md_.obj_box_max_.back();
     }
-
-    bool in_local = idx(0) >= min_id(0) && idx(0) <= max_id(0) && idx(1) >= min_id(1) &&
-                    idx(1) <= max_id(1) && idx(2) >= min_id(2) && idx(2) <= max_id(2);
-    if (!in_local)
+    else
     {
-      md_.occupancy_buffer_[idx_ctns] = mp_.clamp_min_log_;
+      md_.obj_bound_min_ = md_.obj_bound_min_.cwiseMin(md_.obj_box_min_.back());
+      md_.obj_bound_max_ = md_.obj_bound_max_.cwiseMax(md_.obj_box_max_.back());
     }
-
-    md_.occupancy_buffer_[idx_ctns] =
-        std::min(std::max(md_.occupancy_buffer_[idx_ctns] + log_odds_update, mp_.clamp_min_log_),
-                 mp_.clamp_max_log_);
   }
 }
 
-Eigen::Vector3d GridMap::closetPointInMap(const Eigen::Vector3d &pt, const Eigen::Vector3d &camera_pt)
+void GridMap::expandLocalBound(const Eigen::Vector3i &min_id, const Eigen::Vector3i &max_id)
 {
-  Eigen::Vector3d diff = pt - camera_pt;
-  Eigen::Vector3d max_tc = mp_.map_max_boundary_ - camera_pt;
-  Eigen::Vector3d min_tc = mp_.map_min_boundary_ - camera_pt;
+  if (md_.local_updated_)
+  {
+    md_.local_bound_min_ = md_.local_bound_min_.cwiseMin(min_id);
+    md_.local_bound_max_ = md_.local_bound_max_.cwiseMax(max_id);
+  }
+  else
+  {
+    md_.local_bound_min_ = min_id;
+    md_.local_bound_max_ = max_id;
+  }
+  md_.local_updated_ = true;
+}
 
-  double min_t = 1000000;
+void GridMap::raycastBlock(int begin, int end, RaycastWorker &worker)
+{
+  worker.traversed_.clear();
+  worker.coarse_traversed_.clear();
 
-  for (int i = 0; i < 3; ++i)
+  RayCaster raycaster;
+  RayPacket packet;
+  Eigen::Vector3i from_id, to_id;
+  int level = 0;
+
+  const Eigen::Vector3i stride(mp_.map_voxel_num_(1) * mp_.map_voxel_num_(2), mp_.map_voxel_num_(2), 1);
+  const int slab_shift = md_.slab_shift_;
+  const int frame = md_.batch_frame_;
+
+  // count a miss in every voxel towards the camera, until reaching one that an
+  // earlier ray of this block has already traversed
+  auto visit_free = [&worker, slab_shift, frame](int adr) {
+    worker.slab_log_[adr >> slab_shift].push_back(uint64_t(adr) << 3 | frame);
+    return worker.traversed_.insert(adr);
+  };
+
+  // the same for blocks of the current coarse level
+  auto visit_coarse = [&worker, &level](int adr) {
+    int key = adr << 3 | level;
+    worker.coarse_log_.push_back(key);
+    return worker.coarse_traversed_.insert(key);
+  };
+
+  // fine voxels where two levels meet, logged once but never cut short
+  auto visit_gap = [&worker, slab_shift, frame](int adr) {
+    if (worker.traversed_.insert(adr))
+      worker.slab_log_[adr >> slab_shift].push_back(uint64_t(adr) << 3 | frame);
+    return true;
+  };
+
+  // voxel of the ray point at the given range, in the grid of a level
+  auto voxel_at = [this](const RayEnd &ray_end, double range, int lvl, Eigen::Vector3i &id) {
+    posToIndex(Eigen::Vector3d(md_.camera_pos_ + range * ray_end.dir), id);
+    boundIndex(id);
+    for (int i = 0; i < 3; ++i)
+      id(i) >>= lvl;
+  };
+
+  for (int i = begin; i < end; ++i)
   {
-    if (fabs(diff[i]) > 0)
-    {
+    const RayEnd &ray_end = md_.ray_ends_[i];
 
-      double t1 = max_tc[i] / diff[i];
-      if (t1 > 0 && t1 < min_t)
-        min_t = t1;
+    // Beyond the k-th coarse range free space is walked in blocks of 2^k
+    // voxels. The endpoint keeps two blocks of full resolution in front of
+    // it, so a block fill never reaches the surface.
 
-      double t2 = min_tc[i] / diff[i];
-      if (t2 > 0 && t2 < min_t)
-        min_t = t2;
-    }
-  }
+    const int far_level = coarseLevel(ray_end.far);
+    const double fine_far = ray_end.far - 2.0 * (1 << far_level) * mp_.resolution_;
 
-  return camera_pt + (min_t - 1e-3) * diff;
+    if (far_level == 0 || fine_far <= max(mp_.coarse_ranges_[0], ray_end.near))
+    {
+      // raycasting between camera center and point
+
+      raycaster.setInput(ray_end.id, ray_end.start_id, ray_end.adr, stride);
+
+      if (mp_.use_ray_packet_ && packet.add(raycaster))
+      {
+        if (packet.full())
+          packet.traverse(visit_free);
+      }
+      else
+      {
+        raycaster.traverse(visit_free);
+      }
+      continue;
+    }
+
+    voxel_at(ray_end, fine_far, 0, to_id);
+    raycaster.setInput(ray_end.id, to_id, ray_end.adr, stride);
+    raycaster.traverse(visit_free);
+    if (raycaster.remaining() > 0)
+      continue;
+
+    double upper = fine_far;
+    bool stopped = false;
+    for (level = coarseLevel(upper); level > 0 && !stopped; --level)
+    {
+      double lower = max(mp_.coarse_ranges_[level - 1], ray_end.near);
+      if (lower >= upper)
+        continue;
+
+      const Eigen::Vector3i &num = md_.coarse_voxel_num_[level];
+      voxel_at(ray_end, upper, level, from_id);
+      voxel_at(ray_end, lower, level, to_id);
+      raycaster.setInput(from_id, to_id, from_id(0) * num(1) * num(2) + from_id(1) * num(2) + from_id(2),
+                         Eigen::Vector3i(num(1) * num(2), num(2), 1));
+      raycaster.traverse(visit_coarse);
+
+      stopped = raycaster.remaining() > 0;
+      if (!stopped)
+      {
+        // the walk ends before the block holding the lower point, which the
+        // ray crosses for at most its diagonal before the next level starts
+        double gap = min(upper, lower + sqrt(3.0) * (1 << level) * mp_.resolution_);
+        voxel_at(ray_end, gap, 0, from_id);
+        voxel_at(ray_end, lower, 0, to_id);
+        raycaster.setInput(from_id, to_id, toAddress(from_id), stride);
+        raycaster.traverse(visit_gap);
+      }
+      upper = lower;
+    }
+    if (stopped)
+      continue;
+
+    voxel_at(ray_end, upper, 0, from_id);
+    raycaster.setInput(from_id, ray_end.start_id, toAddress(from_id), stride);
+    raycaster.traverse(visit_free);
+  }
+  packet.traverse(visit_free);
+}
+
+// Every coarse block missed by a ray adds one miss to each of its voxels in
+// the clip box, except the voxels a ray of this frame ended in as a hit.
+void GridMap::fillCoarseBlocks()
+{
+  vector<int> &blocks = md_.coarse_blocks_;
+  blocks.clear();
+  for (RaycastWorker &worker : md_.raycast_workers_)
+  {
+    blocks.insert(blocks.end(), worker.coarse_log_.begin(), worker.coarse_log_.end());
+    worker.coarse_log_.clear();
+  }
+  if (blocks.empty())
+    return;
+
+  sort(blocks.begin(), blocks.end());
+  blocks.erase(unique(blocks.begin(), blocks.end()), blocks.end());
+
+  const int block_num = blocks.size();
+  const int slab_shift = md_.slab_shift_;
+  const int frame = md_.batch_frame_;
+  const int frames = mp_.max_coalesced_frames_;
+
+#pragma omp parallel for schedule(dynamic, 64) num_threads(md_.raycast_workers_.size())
+  for (int b = 0; b < block_num; ++b)
+  {
+    RaycastWorker &worker = md_.raycast_workers_[fusionThreadId()];
+
+    const int level = blocks[b] & 7;
+    const int adr = blocks[b] >> 3;
+    const Eigen::Vector3i &num = md_.coarse_voxel_num_[level];
+    Eigen::Vector3i block(adr / (num(1) * num(2)), adr / num(2) % num(1), adr % num(2));
+
+    Eigen::Vector3i min_id, max_id;
+    for (int i = 0; i < 3; ++i)
+    {
+      min_id(i) = max(block(i) << level, md_.ray_clip_min_id_(i));
+      max_id(i) = min(((block(i) + 1) << level) - 1, md_.ray_clip_max_id_(i));
+    }
+
+    for (int x = min_id(0); x <= max_id(0); ++x)
+      for (int y = min_id(1); y <= max_id(1); ++y)
+        for (int z = min_id(2); z <= max_id(2); ++z)
+        {
+          int idx_ctns = toAddress(x, y, z);
+          // only the endpoint counters are in yet, the traversal logs are
+          // merged later
+          if ((md_.count_frames_[idx_ctns] >> frame & 1) && md_.count_votes_[(size_t)idx_ctns * frames + frame] > 0)
+            continue;
+          worker.slab_log_[idx_ctns >> slab_shift].push_back(uint64_t(idx_ctns) << 3 | frame);
+        }
+  }
+}
+
+// interleave the low five bits of u and v
+static inline int mortonCell(int u, int v)
+{
+  int code = 0;
+  for (int b = 0; b < 5; ++b)
+    code |= (((u >> b) & 1) << (2 * b)) | (((v >> b) & 1) << (2 * b + 1));
+  return code;
+}
+
+// Rays are bucketed by the cube map cell of their direction and the buckets
+// are visited face by face in Morton order, so consecutive rays (and the
+// blocks that share early-exit state) leave the camera almost in parallel
+// and walk the same cache lines. The counting sort is stable, so the order
+// only depends on the frame.
+void GridMap::sortRaysByDirection()
+{
+  const int ray_num = md_.proj_points_cnt;
+  md_.ray_bin_.resize(ray_num);
+  md_.ray_bin_start_.assign(RAY_SORT_BINS + 1, 0);
+  if (md_.proj_points_sorted_.size() < md_.proj_points_.size())
+    md_.proj_points_sorted_.resize(md_.proj_points_.size());
+
+  for (int i = 0; i < ray_num; ++i)
+  {
+    Eigen::Vector3d dir = md_.proj_points_[i] - md_.camera_pos_;
+    Eigen::Vector3d mag = dir.cwiseAbs();
+
+    int axis = mag(0) >= mag(1) ? (mag(0) >= mag(2) ? 0 : 2) : (mag(1) >= mag(2) ? 1 : 2);
+    int bin = 0;
+    if (mag(axis) > 0.0)
+    {
+      // the two minor components projected onto the face, mapped to cells
+      double scale = 0.5 * RAY_SORT_CELLS / mag(axis);
+      int u = (int)((dir((axis + 1) % 3) + mag(axis)) * scale);
+      int v = (int)((dir((axis + 2) % 3) + mag(axis)) * scale);
+      u = min(u, RAY_SORT_CELLS - 1);
+      v = min(v, RAY_SORT_CELLS - 1);
+
+      int face = 2 * axis + (dir(axis) < 0.0);
+      bin = face * RAY_SORT_CELLS * RAY_SORT_CELLS + mortonCell(u, v);
+    }
+
+    md_.ray_bin_[i] = bin;
+    md_.ray_bin_start_[bin + 1]++;
+  }
+
+  for (int b = 0; b < RAY_SORT_BINS; ++b)
+    md_.ray_bin_start_[b + 1] += md_.ray_bin_start_[b];
+
+  for (int i = 0; i < ray_num; ++i)
+    md_.proj_points_sorted_[md_.ray_bin_start_[md_.ray_bin_[i]]++] = md_.proj_points_[i];
+
+  md_.proj_points_.swap(md_.proj_points_sorted_);
+}
+
+void GridMap::raycastProcess()
+{
+  // if (md_.proj_points_.size() == 0)
+  if (md_.proj_points_cnt == 0)
+    return;
+
+  if (mp_.sort_rays_)
+    sortRaysByDirection();
+
+  Eigen::Vector3i cam_id;
+  posToIndex(md_.camera_pos_, cam_id);
+
+  // rays are clipped to the voxels this frame may update
+  localUpdateBox(md_.ray_clip_min_id_, md_.ray_clip_max_id_);
+  md_.ray_clip_min_ = mp_.map_origin_ + md_.ray_clip_min_id_.cast<double>() * mp_.resolution_;
+  md_.ray_clip_max_ =
+      mp_.map_origin_ + (md_.ray_clip_max_id_ + Eigen::Vector3i::Ones()).cast<double>() * mp_.resolution_;
+
+  // hits and clipped misses are counted per endpoint voxel, so the tracing
+  // below scales with distinct endpoints rather than pixels
+  collectRayEnds(cam_id);
+
+  // Rays are traced in fixed blocks whose early-exit state does not depend on
+  // how blocks are spread over threads, so the counters (and the map) are
+  // the same for any thread count.
+  const int ray_num = md_.ray_ends_.size();
+  const int block_num = (ray_num + RAYCAST_BLOCK - 1) / RAYCAST_BLOCK;
+
+#pragma omp parallel for schedule(dynamic) num_threads(md_.raycast_workers_.size())
+  for (int b = 0; b < block_num; ++b)
+  {
+    raycastBlock(b * RAYCAST_BLOCK, min((b + 1) * RAYCAST_BLOCK, ray_num), md_.raycast_workers_[fusionThreadId()]);
+  }
+
+  fillCoarseBlocks();
+}
+
+void GridMap::updateOccupancyCounts()
+{
+  // every slab is owned by one thread, which merges the logs of all workers
+  // and then updates the voxels it touched
+  //
+  // With several frames in the counters, each frame's winning side is
+  // applied in the order of the frames, so a batch moves a voxel exactly as
+  // far as its frames would have one by one.
+
+#pragma omp parallel for schedule(dynamic) num_threads(md_.raycast_workers_.size())
+  for (int s = 0; s < RAYCAST_SLABS; ++s)
+  {
+    mergeSlabLogs(s);
+
+    vector<int> &slab_voxel = md_.slab_voxel_[s];
+    for (int idx_ctns : slab_voxel)
+    {
+      md_.occupancy_buffer_[idx_ctns] = countedOccupancy(idx_ctns);
+
+      memset(&md_.count_votes_[(size_t)idx_ctns * mp_.max_coalesced_frames_], 0, mp_.max_coalesced_frames_ * sizeof(short));
+      md_.count_frames_[idx_ctns] = 0;
+    }
+    slab_voxel.clear();
+  }
+}
+
+// the counters only, the voxels are updated by a later updateOccupancyCounts()
+void GridMap::mergeRayCounts()
+{
+#pragma omp parallel for schedule(dynamic) num_threads(md_.raycast_workers_.size())
+  for (int s = 0; s < RAYCAST_SLABS; ++s)
+    mergeSlabLogs(s);
+}
+
+void GridMap::mergeSlabLogs(int s)
+{
+  vector<int> &slab_voxel = md_.slab_voxel_[s];
+
+  // blocks go to whichever worker is free, so every worker keeps room for the
+  // longest log of the slab and stops growing once the loop is warm
+  size_t log_max = 0;
+  for (RaycastWorker &worker : md_.raycast_workers_)
+    log_max = max(log_max, worker.slab_log_[s].size());
+
+  for (RaycastWorker &worker : md_.raycast_workers_)
+  {
+    for (uint64_t entry : worker.slab_log_[s])
+    {
+      int idx_ctns = int(entry >> 3), frame = int(entry & 7);
+
+      if (md_.count_frames_[idx_ctns] == 0)
+        slab_voxel.push_back(idx_ctns);
+
+      md_.count_frames_[idx_ctns] |= 1 << frame;
+      md_.count_votes_[(size_t)idx_ctns * mp_.max_coalesced_frames_ + frame]--;
+    }
+    worker.slab_log_[s].clear();
+    worker.slab_log_[s].reserve(log_max);
+  }
+}
+
+void GridMap::projectiveProcess(const DepthFrame &frame)
+{
+  md_.has_first_depth_ = true;
+
+  // with min pooling, every voxel is compared against the closest depth of its
+  // pixel block, which keeps thin obstacles from being carved out
+  const cv::Mat *depth_img = &frame.depth_;
+  int margin = mp_.use_depth_filter_ ? mp_.depth_filter_margin_ : 0;
+  int pool = 1;
+  if (mp_.use_min_pool_)
+  {
+    pool = max(mp_.skip_pixel_, 1);
+    minPoolDepth(frame.depth_, margin, pool, mp_.pool_min_raw_, md_.depth_pool_);
+    depth_img = &md_.depth_pool_;
+  }
+  if (depth_img->rows == 0 || depth_img->cols == 0)
+    return;
+
+  const int cols = frame.depth_.cols, rows = frame.depth_.rows;
+  const Eigen::Matrix3d &camera_r = frame.camera_r_m_;
+  const Eigen::Matrix3d r_inv = camera_r.transpose();
+  const Eigen::Vector3d cam = frame.camera_pos_;
+  const double inv_factor = 1.0 / mp_.k_depth_scaling_factor_;
+  const double max_range = mp_.max_ray_length_;
+  // a voxel is hit when the surface passes within half its diagonal
+  const double hit_tol = 0.5 * sqrt(3.0) * mp_.resolution_;
+
+  /* ---------- voxels of the frustum inside the local update box ---------- */
+  Eigen::Vector3d box_min = cam, box_max = cam;
+  const int samples = 8;
+  for (int i = 0; i <= samples; ++i)
+    for (int j = 0; j <= samples; ++j)
+    {
+      Eigen::Vector3d dir((cols * i / samples - mp_.cx_) / mp_.fx_, (rows * j / samples - mp_.cy_) / mp_.fy_, 1.0);
+      Eigen::Vector3d far_pt = cam + camera_r * dir.normalized() * max_range;
+      box_min = box_min.cwiseMin(far_pt);
+      box_max = box_max.cwiseMax(far_pt);
+    }
+
+  Eigen::Vector3i min_id, max_id, local_min, local_max;
+  posToIndex(box_min, min_id);
+  posToIndex(box_max, max_id);
+  localUpdateBox(local_min, local_max);
+  min_id = min_id.cwiseMax(local_min);
+  max_id = max_id.cwiseMin(local_max);
+  if ((min_id.array() > max_id.array()).any())
+    return;
+
+  expandLocalBound(min_id, max_id);
+
+  const int col_len = max_id(2) - min_id(2) + 1;
+  const Eigen::Vector3d step_z = r_inv.col(2) * mp_.resolution_;
+  for (RaycastWorker &worker : md_.raycast_workers_)
+  {
+    worker.column_z_.resize(col_len);
+    worker.column_u_.resize(col_len);
+    worker.column_v_.resize(col_len);
+    worker.column_range_.resize(col_len);
+  }
+
+#pragma omp parallel for schedule(dynamic) num_threads(md_.raycast_workers_.size())
+  for (int x = min_id(0); x <= max_id(0); ++x)
+  {
+    Eigen::Vector3d pos;
+    RaycastWorker &worker = md_.raycast_workers_[fusionThreadId()];
+    double *pz = worker.column_z_.data(), *pu = worker.column_u_.data();
+    double *pv = worker.column_v_.data(), *pr = worker.column_range_.data();
+
+    for (int y = min_id(1); y <= max_id(1); ++y)
+    {
+      indexToPos(Eigen::Vector3i(x, y, min_id(2)), pos);
+      const Eigen::Vector3d pc0 = r_inv * (pos - cam);
+
+      // camera coordinates along a column are affine in z
+      for (int k = 0; k < col_len; ++k)
+      {
+        Eigen::Vector3d pc = pc0 + k * step_z;
+        pz[k] = pc(2);
+        pu[k] = pc(0) * mp_.fx_ / pc(2) + mp_.cx_;
+        pv[k] = pc(1) * mp_.fy_ / pc(2) + mp_.cy_;
+        pr[k] = pc.norm();
+      }
+
+      int adr = toAddress(x, y, min_id(2));
+      for (int k = 0; k < col_len; ++k, ++adr)
+      {
+        if (pz[k] < 1e-3 || pr[k] > max_range)
+          continue;
+
+        // pixels within the margin of the border are rejected; the pooled
+        // image starts past the margin, the full one at the border
+        int u = (int)floor(pu[k]), v = (int)floor(pv[k]);
+        if (u < margin || v < margin || u >= cols - margin || v >= rows - margin)
+          continue;
+        if (mp_.use_min_pool_)
+        {
+          u = (u - margin) / pool, v = (v - margin) / pool;
+          if (u >= depth_img->cols || v >= depth_img->rows)
+            continue;
+        }
+
+        uint16_t raw = depth_img->ptr<uint16_t>(v)[u];
+        double depth = raw * inv_factor;
+
+        // free / occupied / unknown against the pixel depth, with the same
+        // filtering as the projected point cloud
+        bool hit;
+        if (raw == 0 || (mp_.use_depth_filter_ && depth > mp_.depth_filter_maxdist_))
+          hit = false;
+        else if (mp_.use_depth_filter_ && depth < mp_.depth_filter_mindist_)
+          continue;
+        else if (pz[k] < depth - hit_tol)
+          hit = false;
+        else if (pz[k] <= depth + hit_tol)
+          hit = true;
+        else
+          continue;
+
+        updateProjectiveVoxel(md_.occupancy_buffer_[adr], hit);
+      }
+    }
+  }
+}
+
+// the same per-voxel test against a LiDAR range image, with the voxel's
+// beam found from its azimuth and elevation in the sensor frame
+void GridMap::projectiveRangeProcess(const DepthFrame &frame)
+{
+  const cv::Mat *range_img = &frame.depth_;
+  const int pool = mp_.lidar_pool_;
+  if (pool > 1)
+  {
+    minPoolDepth(frame.depth_, 0, pool, 1, md_.range_pool_);
+    range_img = &md_.range_pool_;
+  }
+  if (range_img->rows == 0 || range_img->cols == 0)
+    return;
+
+  const Eigen::Matrix3d r_inv = frame.camera_r_m_.transpose();
+  const Eigen::Vector3d cam = frame.camera_pos_;
+  const double inv_factor = 1.0 / mp_.k_depth_scaling_factor_;
+  const double max_range = mp_.max_ray_length_;
+  const double hit_tol = 0.5 * sqrt(3.0) * mp_.resolution_;
+
+  Eigen::Vector3i min_id, max_id, local_min, local_max;
+  posToIndex(cam - Eigen::Vector3d::Constant(max_range), min_id);
+  posToIndex(cam + Eigen::Vector3d::Constant(max_range), max_id);
+  localUpdateBox(local_min, local_max);
+  min_id = min_id.cwiseMax(local_min);
+  max_id = max_id.cwiseMin(local_max);
+  if ((min_id.array() > max_id.array()).any())
+    return;
+
+  expandLocalBound(min_id, max_id);
+
+#pragma omp parallel for schedule(dynamic) num_threads(md_.raycast_workers_.size())
+  for (int x = min_id(0); x <= max_id(0); ++x)
+  {
+    Eigen::Vector3d pos;
+    for (int y = min_id(1); y <= max_id(1); ++y)
+    {
+      int adr = toAddress(x, y, min_id(2));
+      for (int z = min_id(2); z <= max_id(2); ++z, ++adr)
+      {
+        indexToPos(Eigen::Vector3i(x, y, z), pos);
+        const Eigen::Vector3d pc = r_inv * (pos - cam);
+        const double range = pc.norm();
+        int row, col;
+        if (range < 1e-3 || range > max_range || !rangeImageCell(pc, range, row, col))
+          continue;
+
+        uint16_t raw = range_img->ptr<uint16_t>(row / pool)[col / pool];
+        double depth = raw * inv_factor;
+
+        bool hit;
+        if (raw == 0)
+        {
+          if (!mp_.lidar_no_return_free_)
+            continue;
+          hit = false;
+        }
+        else if (range < depth - hit_tol)
+          hit = false;
+        else if (range <= depth + hit_tol)
+          hit = true;
+        else
+          continue;
+
+        updateProjectiveVoxel(md_.occupancy_buffer_[adr], hit);
+      }
+    }
+  }
+}
+
+void GridMap::localUpdateBox(Eigen::Vector3i &min_id, Eigen::Vector3i &max_id)
+{
+  posToIndex(md_.camera_pos_ - mp_.local_update_range_, min_id);
+  posToIndex(md_.camera_pos_ + mp_.local_update_range_, max_id);
+
+  // the map starts at the ground; the ceiling keeps voxels entirely below it
+  if (mp_.virtual_ceil_height_ > mp_.ground_height_)
+  {
+    int ceil_id = floor((mp_.virtual_ceil_height_ - mp_.map_origin_(2)) * mp_.resolution_inv_) - 1;
+    max_id(2) = min(max_id(2), ceil_id);
+  }
+
+  boundIndex(min_id);
+  boundIndex(max_id);
+}
+
+bool GridMap::clipRay(const Eigen::Vector3d &ray, double &t_in, double &t_out)
+{
+  for (int i = 0; i < 3; ++i)
+  {
+    const double origin = md_.camera_pos_(i);
+
+    if (fabs(ray(i)) < 1e-12)
+    {
+      if (origin < md_.ray_clip_min_(i) || origin >= md_.ray_clip_max_(i))
+        return false;
+      continue;
+    }
+
+    double t0 = (md_.ray_clip_min_(i) - origin) / ray(i);
+    double t1 = (md_.ray_clip_max_(i) - origin) / ray(i);
+    if (t0 > t1)
+      swap(t0, t1);
+
+    t_in = max(t_in, t0);
+    t_out = min(t_out, t1);
+  }
+
+  return t_in < t_out;
 }
 
-void GridMap::clearAndInflateLocalMap()
+void GridMap::clearLocalMap()
 {
   /*clear outside local*/
-  const int vec_margin = 5;
+  const int vec_margin = LOCAL_CLEAR_MARGIN;
   // Eigen::Vector3i min_vec_margin = min_vec - Eigen::Vector3i(vec_margin,
   // vec_margin, vec_margin); Eigen::Vector3i max_vec_margin = max_vec +
   // Eigen::Vector3i(vec_margin, vec_margin, vec_margin);
@@ -592,157 +1729,738 @@ void GridMap::clearAndInflateLocalMap()
 
       for (int x = max_cut(0) + 1; x <= max_cut_m(0); ++x)
       {
-        int idx = toAddress(x, y, z);
-        md_.occupancy_buffer_[idx] = mp_.clamp_min_log_ - mp_.unknown_flag_;
+        int idx = toAddress(x, y, z);
+        md_.occupancy_buffer_[idx] = mp_.clamp_min_log_ - mp_.unknown_flag_;
+      }
+    }
+
+}
+
+void GridMap::collectOccupied(InflateJob &job, bool counted)
+{
+  job.bound_min_ = md_.local_bound_min_;
+  job.bound_max_ = md_.local_bound_max_;
+  job.occupied_.clear();
+  // room for half again the most a job has held, so a pooled job stops
+  // growing once the map is warm without reserving the whole box
+  job.occupied_.reserve(md_.occupied_max_ + md_.occupied_max_ / 2);
+
+  // the state box also covers the ring clearLocalMap() resets
+  const Eigen::Vector3i ring = Eigen::Vector3i::Constant(mp_.local_map_margin_ + LOCAL_CLEAR_MARGIN);
+  job.state_min_ = md_.local_bound_min_ - ring;
+  job.state_max_ = md_.local_bound_max_ + ring;
+  boundIndex(job.state_min_);
+  boundIndex(job.state_max_);
+  Eigen::Vector3i box = job.state_max_ - job.state_min_ + Eigen::Vector3i::Ones();
+  job.state_.resize(box.prod());
+
+  char *state = job.state_.data();
+  for (int x = job.state_min_(0); x <= job.state_max_(0); ++x)
+    for (int y = job.state_min_(1); y <= job.state_max_(1); ++y)
+    {
+      const bool in_bound = x >= md_.local_bound_min_(0) && x <= md_.local_bound_max_(0) &&
+                            y >= md_.local_bound_min_(1) && y <= md_.local_bound_max_(1);
+      for (int z = job.state_min_(2); z <= job.state_max_(2); ++z)
+      {
+        int adr = toAddress(x, y, z);
+        double occ = counted && md_.count_frames_[adr] != 0 ? countedOccupancy(adr) : md_.occupancy_buffer_[adr];
+        if (occ < mp_.clamp_min_log_ - 1e-3)
+        {
+          *state++ = VOXEL_UNKNOWN;
+          continue;
+        }
+        *state++ = occ > mp_.min_occupancy_log_ ? VOXEL_OCCUPIED : VOXEL_FREE;
+        if (occ > mp_.min_occupancy_log_ && in_bound && z >= md_.local_bound_min_(2) && z <= md_.local_bound_max_(2))
+          job.occupied_.push_back(adr);
+      }
+    }
+  md_.occupied_max_ = max(md_.occupied_max_, job.occupied_.size());
+}
+
+void GridMap::inflateLocalMap(const InflateJob &job)
+{
+  // inflate occupied voxels to compensate robot size
+
+  int inf_step = ceil(mp_.obstacles_inflation_ / mp_.resolution_);
+  // int inf_step_z = 1;
+  vector<Eigen::Vector3i> &inf_pts = md_.inf_pts_;
+  inf_pts.resize(pow(2 * inf_step + 1, 3));
+  // inf_pts.resize(4 * inf_step + 3);
+  Eigen::Vector3i inf_pt, id;
+
+  std::lock_guard<std::mutex> lock(inflate_mutex_);
+
+  // clear outdated data
+  clearInflation(job.bound_min_, job.bound_max_);
+
+  // states of the job box, column by column
+  int z = job.state_min_(2);
+  const int state_len = job.state_max_(2) - z + 1;
+  const char *state = job.state_.data();
+  for (int x = job.state_min_(0); x <= job.state_max_(0); ++x)
+    for (int y = job.state_min_(1); y <= job.state_max_(1); ++y, state += state_len)
+      memcpy(&md_.occupancy_state_[toAddress(x, y, z)], state, state_len);
+
+  // inflate obstacles
+  for (int adr : job.occupied_)
+  {
+    addressToIndex(adr, id);
+    inflatePoint(id, inf_step, inf_pts);
+
+    for (int k = 0; k < (int)inf_pts.size(); ++k)
+    {
+      inf_pt = inf_pts[k];
+      int idx_inf = toAddress(inf_pt);
+      if (idx_inf < 0 ||
+          idx_inf >= mp_.map_voxel_num_(0) * mp_.map_voxel_num_(1) * mp_.map_voxel_num_(2))
+      {
+        continue;
+      }
+      md_.occupancy_buffer_inflate_[idx_inf] = 1;
+    }
+  }
+
+  const Eigen::Vector3i inf_reach = Eigen::Vector3i::Constant(inf_step);
+  publishInflateVersion((job.bound_min_ - inf_reach).cwiseMin(job.state_min_),
+                        (job.bound_max_ + inf_reach).cwiseMax(job.state_max_), job.bound_min_, job.bound_max_);
+}
+
+bool GridMap::fuseFrames(vector<DepthFramePtr> &frames, InflateJob &job)
+{
+  ros::Time t1, t2;
+  t1 = ros::Time::now();
+
+  // Frames that piled up are fused as one batch: their hit and miss counts
+  // are accumulated first and then applied in a single log-odds pass, and
+  // the union of their local boxes is inflated once.
+  md_.batch_frame_ = 0;
+  for (DepthFramePtr &frame : frames)
+  {
+    md_.camera_pos_ = frame->camera_pos_;
+    md_.camera_r_m_ = frame->camera_r_m_;
+
+    if (mp_.use_projective_fusion_ && frame->range_image_)
+    {
+      projectiveRangeProcess(*frame);
+    }
+    else if (mp_.use_projective_fusion_ && !frame->cloud_)
+    {
+      projectiveProcess(*frame);
+    }
+    else
+    {
+      // the frame takes back the points of the previous one, so projection
+      // and raycasting always work on different buffers
+      md_.proj_points_.swap(frame->proj_points_);
+      md_.proj_points_cnt = frame->proj_points_cnt_;
+      updateObjBoxes(frame->stamp_);
+      raycastProcess();
+      md_.batch_frame_++;
+    }
+  }
+
+  if (md_.batch_frame_ > 0 && md_.local_updated_)
+    updateOccupancyCounts();
+
+  t2 = ros::Time::now();
+
+  md_.update_num_ += 1;
+  md_.fuse_time_ += (t2 - t1).toSec();
+  md_.max_fuse_time_ = max(md_.max_fuse_time_, (t2 - t1).toSec());
+
+  if (mp_.show_occ_time_)
+    ROS_WARN("Fusion: frames = %d, cur t = %lf, avg t = %lf, max t = %lf", (int)frames.size(), (t2 - t1).toSec(),
+             md_.fuse_time_ / md_.update_num_, md_.max_fuse_time_);
+
+  if (!md_.local_updated_)
+    return false;
+  md_.local_updated_ = false;
+
+  // everything that reads occupancy_buffer_ is done here, inflation only
+  // needs the occupied voxels
+  clearLocalMap();
+  collectOccupied(job);
+  return true;
+}
+
+// Fast path at speed: the rays of the batch inside a cone along the body
+// velocity are fused and collected for inflation on their own, and taken
+// out of the frames, whose remaining rays go through fuseFrames() next.
+bool GridMap::fusePriorityRays(vector<DepthFramePtr> &frames, InflateJob &job)
+{
+  if (!mp_.velocity_priority_ || frames.empty())
+    return false;
+
+  Eigen::Vector3d vel;
+  if (!odomVelocity(frames.back()->stamp_.toSec(), vel) || vel.norm() < mp_.priority_min_speed_)
+    return false;
+
+  ros::Time t1 = ros::Time::now();
+  const Eigen::Vector3d dir = vel.normalized();
+  const double cos_cone = cos(mp_.priority_cone_);
+  int cone_num = 0, ray_num = 0;
+
+  md_.batch_frame_ = 0;
+  for (DepthFramePtr &frame : frames)
+  {
+    if (mp_.use_projective_fusion_ && (!frame->cloud_ || frame->range_image_))
+      continue;
+
+    md_.camera_pos_ = frame->camera_pos_;
+    md_.camera_r_m_ = frame->camera_r_m_;
+
+    if ((int)md_.proj_points_.size() < frame->proj_points_cnt_)
+      md_.proj_points_.resize(frame->proj_points_cnt_);
+
+    // cone rays move to the map buffer, the rest stay in order in the frame
+    md_.proj_points_cnt = 0;
+    int rest = 0;
+    for (int i = 0; i < frame->proj_points_cnt_; ++i)
+    {
+      const Eigen::Vector3d &pt = frame->proj_points_[i];
+      Eigen::Vector3d ray = pt - frame->camera_pos_;
+      if (ray.dot(dir) >= cos_cone * ray.norm())
+        md_.proj_points_[md_.proj_points_cnt++] = pt;
+      else
+        frame->proj_points_[rest++] = pt;
+    }
+    ray_num += frame->proj_points_cnt_;
+    frame->proj_points_cnt_ = rest;
+
+    cone_num += md_.proj_points_cnt;
+
+    // counted under the batch index fuseFrames() gives the frame
+    if (md_.proj_points_cnt > 0)
+    {
+      updateObjBoxes(frame->stamp_);
+      raycastProcess();
+    }
+    md_.batch_frame_++;
+  }
+
+  if (!md_.local_updated_)
+    return false;
+
+  // The counts stay in place and fuseFrames() adds the rest of the rays to
+  // the same frame votes, and the local bound stays open for it. This is
+  // close to fusing the batch at once, but not the same: each pass merges its
+  // own ray ends and stops rays only at voxels it traversed itself, so a
+  // voxel crossed by rays of both passes takes more misses, and cone rays can
+  // miss through a voxel that only the rest of the rays hit. The fast version
+  // is inflated from what the voxels would be with the cone rays alone.
+  mergeRayCounts();
+  collectOccupied(job, true);
+
+  if (mp_.show_occ_time_)
+    ROS_WARN("Priority fusion: rays = %d of %d, speed = %lf, t = %lf", cone_num, ray_num, vel.norm(),
+             (ros::Time::now() - t1).toSec());
+  return true;
+}
+
+// mean body velocity over velocity_window_ of odometry up to the stamp
+bool GridMap::odomVelocity(double stamp, Eigen::Vector3d &vel)
+{
+  Eigen::Vector3d pos0, pos1;
+  Eigen::Quaterniond q;
+  double t = min(stamp, odom_buffer_.newestStamp());
+
+  if (odom_buffer_.interpolate(t, pos1, q) != PoseBuffer::OK ||
+      odom_buffer_.interpolate(t - mp_.velocity_window_, pos0, q) != PoseBuffer::OK)
+    return false;
+
+  vel = (pos1 - pos0) / mp_.velocity_window_;
+  return true;
+}
+
+void GridMap::startFusionThreads()
+{
+  // frames wait in the queues until the fusion stage can take them as a batch
+  frame_ring_.init(mp_.max_coalesced_frames_, frame_pool_.recycler());
+  frame_pushing_ = false;
+  raycast_queue_.setCapacity(mp_.max_coalesced_frames_);
+
+  // enough for a batch in the ring, waiting for odometry, in every stage and
+  // between them, plus the frame being filled; the pools only grow if that
+  // is too few
+  frame_pool_.reserve(5 * mp_.max_coalesced_frames_ + 2);
+  pose_waiting_.reserve(mp_.max_coalesced_frames_);
+  job_pool_.reserve(4);
+
+  if (mp_.pipeline_fusion_)
+  {
+    mapping_thread_ = std::thread(&GridMap::projectStage, this);
+    raycast_thread_ = std::thread(&GridMap::raycastStage, this);
+    inflate_thread_ = std::thread(&GridMap::inflateStage, this);
+  }
+  else
+  {
+    mapping_thread_ = std::thread(&GridMap::fusionStage, this);
+  }
+}
+
+void GridMap::stopFusionThreads()
+{
+  // stages are closed front to back, so frames already inside are finished
+  frame_ring_.close();
+  if (mapping_thread_.joinable())
+    mapping_thread_.join();
+
+  raycast_queue_.close();
+  if (raycast_thread_.joinable())
+    raycast_thread_.join();
+
+  inflate_queue_.close();
+  if (inflate_thread_.joinable())
+    inflate_thread_.join();
+}
+
+// OpenMP teams started from the mapping thread inherit its cores
+void GridMap::pinMappingThread()
+{
+  if (mp_.mapping_cpus_.empty())
+    return;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for (int cpu : mp_.mapping_cpus_)
+    if (cpu >= 0 && cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &cpus);
+
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  if (err != 0)
+    ROS_WARN("Failed to pin the mapping thread: %s", strerror(err));
+}
+
+// take the frames waiting in the ring, oldest first. A frame whose pose is
+// still to come from odometry is held back in pose_waiting_, with the frames
+// behind it so they keep their order, and the thread sleeps until odometry
+// pokes the ring, a new frame comes, or the first frame gives up waiting
+bool GridMap::popFrames(vector<DepthFramePtr> &frames)
+{
+  static thread_local vector<DepthFrame *> taken;
+  const size_t max_frames = mp_.max_coalesced_frames_;
+  frames.clear();
+  while (true)
+  {
+    size_t done = 0;
+    for (; done < pose_waiting_.size() && frames.size() < max_frames; ++done)
+    {
+      DepthFrame &frame = *pose_waiting_[done];
+      if (frame.pose_pending_)
+      {
+        PoseStatus status = resolveFramePose(frame);
+        if (status == POSE_WAIT)
+          break;
+        if (status == POSE_DROP)
+          continue;
       }
+      if (decodeDepth(frame))
+        frames.push_back(std::move(pose_waiting_[done]));
     }
+    pose_waiting_.erase(pose_waiting_.begin(), pose_waiting_.begin() + done);
+    if (!frames.empty())
+      break;
 
-  // inflate occupied voxels to compensate robot size
+    bool open;
+    if (pose_waiting_.empty())
+      open = frame_ring_.popAll(taken, max_frames);
+    else
+      open = frame_ring_.popUntil(taken, max_frames - pose_waiting_.size(), pose_waiting_.front()->pose_deadline_);
+    if (!open)
+      return false;
+
+    const std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(mp_.odom_wait_max_));
+    for (DepthFrame *frame : taken)
+    {
+      frame->pose_deadline_ = deadline;
+      pose_waiting_.push_back(frame_pool_.adopt(frame));
+    }
+  }
 
-  int inf_step = ceil(mp_.obstacles_inflation_ / mp_.resolution_);
-  // int inf_step_z = 1;
-  vector<Eigen::Vector3i> inf_pts(pow(2 * inf_step + 1, 3));
-  // inf_pts.resize(4 * inf_step + 3);
-  Eigen::Vector3i inf_pt;
+  if (mp_.show_occ_time_)
+    ROS_WARN("Frame ring: taken = %d, waiting = %d, for odometry = %d, dropped = %lu", (int)frames.size(),
+             frame_ring_.depth(), (int)pose_waiting_.size(), (unsigned long)frame_ring_.dropped());
+  return true;
+}
 
-  // clear outdated data
-  for (int x = md_.local_bound_min_(0); x <= md_.local_bound_max_(0); ++x)
-    for (int y = md_.local_bound_min_(1); y <= md_.local_bound_max_(1); ++y)
-      for (int z = md_.local_bound_min_(2); z <= md_.local_bound_max_(2); ++z)
-      {
-        md_.occupancy_buffer_inflate_[toAddress(x, y, z)] = 0;
-      }
+// camera pose at the image stamp; by now odometry has usually caught up,
+// and if it is still behind the frame waits for it until pose_deadline_
+GridMap::PoseStatus GridMap::resolveFramePose(DepthFrame &frame)
+{
+  Eigen::Vector3d body_pos;
+  Eigen::Quaterniond body_q;
+  double stamp = frame.stamp_.toSec();
 
-  // inflate obstacles
-  for (int x = md_.local_bound_min_(0); x <= md_.local_bound_max_(0); ++x)
-    for (int y = md_.local_bound_min_(1); y <= md_.local_bound_max_(1); ++y)
-      for (int z = md_.local_bound_min_(2); z <= md_.local_bound_max_(2); ++z)
-      {
+  PoseBuffer::Result res = odom_buffer_.interpolate(stamp, body_pos, body_q);
+  if (res == PoseBuffer::TOO_NEW && stamp - odom_buffer_.newestStamp() <= mp_.odom_sync_tolerance_)
+    res = PoseBuffer::OK;
+  if (res == PoseBuffer::TOO_NEW && std::chrono::steady_clock::now() < frame.pose_deadline_)
+    return POSE_WAIT;
 
-        if (md_.occupancy_buffer_[toAddress(x, y, z)] > mp_.min_occupancy_log_)
-        {
-          inflatePoint(Eigen::Vector3i(x, y, z), inf_step, inf_pts);
+  if (res != PoseBuffer::OK)
+  {
+    ROS_WARN_THROTTLE(1.0, "No odometry around depth stamp %f (%s), frame dropped", stamp,
+                      res == PoseBuffer::TOO_NEW ? "odometry behind" : "outside the odometry buffer");
+    return POSE_DROP;
+  }
 
-          for (int k = 0; k < (int)inf_pts.size(); ++k)
-          {
-            inf_pt = inf_pts[k];
-            int idx_inf = toAddress(inf_pt);
-            if (idx_inf < 0 ||
-                idx_inf >= mp_.map_voxel_num_(0) * mp_.map_voxel_num_(1) * mp_.map_voxel_num_(2))
-            {
-              continue;
-            }
-            md_.occupancy_buffer_inflate_[idx_inf] = 1;
-          }
-        }
-      }
+  Eigen::Matrix3d body_r_m = body_q.toRotationMatrix();
+  frame.camera_pos_ = body_r_m * frame.cam2body_t_ + body_pos;
+  frame.camera_r_m_ = body_r_m * frame.cam2body_r_;
+  frame.pose_pending_ = false;
 
+  // as for frames that come with their pose
+  if (!isInMap(frame.camera_pos_))
+  {
+    ROS_WARN_THROTTLE(1.0, "Camera outside the map at depth stamp %f, frame dropped", stamp);
+    return POSE_DROP;
+  }
+  return POSE_OK;
 }
 
-void GridMap::visCallback(const ros::TimerEvent & /*event*/)
+// all three steps of a frame in turn, on a single thread
+void GridMap::fusionStage()
 {
+  pinMappingThread();
 
-  publishMapInflate(true);
-  publishMap();
+  vector<DepthFramePtr> frames;
+  InflateJob job;
+  int cycles = 0;
+  uint64_t allocs = alloc_counter::threadAllocations();
+  while (popFrames(frames))
+  {
+    for (DepthFramePtr &frame : frames)
+      projectFrame(*frame);
+    // the forward map is published before the rest of the frame is traced
+    if (fusePriorityRays(frames, job))
+      inflateLocalMap(job);
+    if (fuseFrames(frames, job))
+      inflateLocalMap(job);
+
+    frames.clear();
+    checkAllocations("Fusion", cycles, allocs);
+  }
 }
 
-void GridMap::updateOccupancyCallback(const ros::TimerEvent & /*event*/)
+void GridMap::projectStage()
 {
-  if (md_.last_occ_update_time_.toSec() < 1.0 ) md_.last_occ_update_time_ = ros::Time::now();
-  
-  if (!md_.occ_need_update_)
+  pinMappingThread();
+
+  vector<DepthFramePtr> frames;
+  int cycles = 0;
+  uint64_t allocs = alloc_counter::threadAllocations();
+  while (popFrames(frames))
   {
-    if ( md_.flag_use_depth_fusion && (ros::Time::now() - md_.last_occ_update_time_).toSec() > mp_.odom_depth_timeout_ )
+    for (DepthFramePtr &frame : frames)
     {
-      ROS_ERROR("odom or depth lost! ros::Time::now()=%f, md_.last_occ_update_time_=%f, mp_.odom_depth_timeout_=%f", 
-        ros::Time::now().toSec(), md_.last_occ_update_time_.toSec(), mp_.odom_depth_timeout_);
-      md_.flag_depth_odom_timeout_ = true;
+      projectFrame(*frame);
+      if (!raycast_queue_.push(std::move(frame)))
+        return;
     }
+    checkAllocations("Projection", cycles, allocs);
+  }
+}
+
+void GridMap::raycastStage()
+{
+  vector<DepthFramePtr> frames;
+  int cycles = 0;
+  uint64_t allocs = alloc_counter::threadAllocations();
+  while (raycast_queue_.popAll(frames, mp_.max_coalesced_frames_))
+  {
+    InflateJobPtr priority_job = job_pool_.acquire();
+    if (fusePriorityRays(frames, *priority_job) && !inflate_queue_.push(std::move(priority_job)))
+      break;
+
+    InflateJobPtr job = job_pool_.acquire();
+    if (fuseFrames(frames, *job) && !inflate_queue_.push(std::move(job)))
+      break;
+
+    frames.clear();
+    checkAllocations("Raycast", cycles, allocs);
+  }
+}
+
+void GridMap::inflateStage()
+{
+  InflateJobPtr job;
+  int cycles = 0;
+  uint64_t allocs = alloc_counter::threadAllocations();
+  while (inflate_queue_.pop(job))
+  {
+    inflateLocalMap(*job);
+    job.reset();
+    checkAllocations("Inflation", cycles, allocs);
+  }
+}
+
+// A stage cycle that still allocates after warm-up is reported, or aborts
+// for allocation tests. Needs the allocation counter built in.
+void GridMap::checkAllocations(const char *stage, int &cycles, uint64_t &allocs)
+{
+  if (!alloc_counter::enabled())
     return;
+
+  uint64_t now = alloc_counter::threadAllocations();
+  if (++cycles > mp_.alloc_warmup_cycles_ && now != allocs)
+  {
+    md_.warm_allocs_ += now - allocs;
+    ROS_ERROR("%s stage allocated %lu times in cycle %d", stage, (unsigned long)(now - allocs), cycles);
+    if (mp_.abort_on_alloc_)
+      std::abort();
   }
-  md_.last_occ_update_time_ = ros::Time::now();
+  // the report itself is not counted
+  allocs = alloc_counter::threadAllocations();
+}
 
-  /* update occupancy */
-  // ros::Time t1, t2, t3, t4;
-  // t1 = ros::Time::now();
+// fusion never waits on this thread: it reads pinned versions of the
+// inflated map, and at nice 19 it only gets cores that fusion leaves idle
+void GridMap::visualizationLoop()
+{
+  if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19) != 0)
+    ROS_WARN("Failed to lower the visualization thread priority: %s", strerror(errno));
 
-  projectDepthImage();
-  // t2 = ros::Time::now();
-  raycastProcess();
-  // t3 = ros::Time::now();
+  const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(1.0 / mp_.visualization_rate_));
+  auto next = std::chrono::steady_clock::now();
 
-  if (md_.local_updated_)
-    clearAndInflateLocalMap();
+  std::unique_lock<std::mutex> lock(vis_mutex_);
+  while (true)
+  {
+    // a slow publication delays the next one instead of queueing more
+    const auto now = std::chrono::steady_clock::now();
+    next = next + period < now ? now + period : next + period;
+    if (vis_cv_.wait_until(lock, next, [this] { return vis_stop_; }))
+      return;
+
+    lock.unlock();
+    publishMapInflate(true);
+    publishMap();
+    publishMapDelta();
+    lock.lock();
+  }
+}
+
+void GridMap::stopVisualization()
+{
+  {
+    std::lock_guard<std::mutex> lock(vis_mutex_);
+    vis_stop_ = true;
+  }
+  vis_cv_.notify_all();
+  if (vis_thread_.joinable())
+    vis_thread_.join();
+}
+
+void GridMap::fusionWatchdogCallback(const ros::TimerEvent & /*event*/)
+{
+  if (md_.last_occ_update_time_.toSec() < 1.0 ) md_.last_occ_update_time_ = ros::Time::now();
 
-  // t4 = ros::Time::now();
+  if ( md_.flag_use_depth_fusion && (ros::Time::now() - md_.last_occ_update_time_).toSec() > mp_.odom_depth_timeout_ )
+  {
+    ROS_ERROR("odom or depth lost! ros::Time::now()=%f, md_.last_occ_update_time_=%f, mp_.odom_depth_timeout_=%f", 
+      ros::Time::now().toSec(), md_.last_occ_update_time_.toSec(), mp_.odom_depth_timeout_);
+    md_.flag_depth_odom_timeout_ = true;
+  }
+}
 
-  // cout << setprecision(7);
-  // cout << "t2=" << (t2-t1).toSec() << " t3=" << (t3-t2).toSec() << " t4=" << (t4-t3).toSec() << endl;;
+DepthFramePtr GridMap::acquireFrame()
+{
+  DepthFramePtr frame = frame_pool_.acquire();
+  frame->image_.reset();
+  frame->compressed_.reset();
+  frame->cloud_.reset();
+  frame->range_image_ = false;
+  frame->proj_points_cnt_ = 0;
+  frame->pose_pending_ = false;
+  return frame;
+}
 
-  // md_.fuse_time_ += (t2 - t1).toSec();
-  // md_.max_fuse_time_ = max(md_.max_fuse_time_, (t2 - t1).toSec());
+void GridMap::submitFrame(DepthFramePtr frame)
+{
+  md_.last_occ_update_time_ = ros::Time::now();
 
-  // if (mp_.show_occ_time_)
-  //   ROS_WARN("Fusion: cur t = %lf, avg t = %lf, max t = %lf", (t2 - t1).toSec(),
-  //            md_.fuse_time_ / md_.update_num_, md_.max_fuse_time_);
+  // a ring of one producer: two callbacks pushing at once would corrupt it
+  if (frame_pushing_.exchange(true))
+  {
+    ROS_ERROR_ONCE("Frame callbacks run concurrently, use a single-threaded spinner for the grid map");
+    return;
+  }
 
-  md_.occ_need_update_ = false;
-  md_.local_updated_ = false;
+  // never blocks the spinner, the oldest waiting frame is dropped when the
+  // mapping thread falls behind
+  frame_ring_.push(frame.release());
+  frame_pushing_.store(false);
 }
 
-void GridMap::depthPoseCallback(const sensor_msgs::ImageConstPtr &img,
-                                const geometry_msgs::PoseStampedConstPtr &pose)
+bool GridMap::decodeDepth(DepthFrame &frame)
 {
-  /* get depth image */
-  cv_bridge::CvImagePtr cv_ptr;
-  cv_ptr = cv_bridge::toCvCopy(img, img->encoding);
+  if (frame.compressed_)
+  {
+    ros::Time t1 = ros::Time::now();
+    bool decoded = false;
+    try
+    {
+      decoded = decodeCompressedDepth(*frame.compressed_, frame.depth_);
+    }
+    catch (const cv::Exception &e)
+    {
+      // imdecode throws on some malformed png data instead of failing
+      ROS_WARN_THROTTLE(1.0, "Compressed depth image not decoded (%s), frame dropped", e.what());
+    }
+    frame.compressed_.reset();
+    if (mp_.show_occ_time_)
+      ROS_WARN("Depth decode: t = %lf", (ros::Time::now() - t1).toSec());
+    return decoded;
+  }
 
-  if (img->encoding == sensor_msgs::image_encodings::TYPE_32FC1)
+  if (!frame.image_)
+    return true;
+
+  // straight from the message into the frame's own depth buffer, which is
+  // reused from the frame's last round
+  const sensor_msgs::Image &img = *frame.image_;
+  const bool is_float = img.encoding == sensor_msgs::image_encodings::TYPE_32FC1;
+  if ((is_float || img.encoding == sensor_msgs::image_encodings::TYPE_16UC1 ||
+       img.encoding == sensor_msgs::image_encodings::MONO16) &&
+      !img.is_bigendian && img.step >= img.width * (is_float ? 4 : 2) && img.data.size() >= img.step * img.height)
+  {
+    cv::Mat src(img.height, img.width, is_float ? CV_32FC1 : CV_16UC1, const_cast<uint8_t *>(img.data.data()), img.step);
+    if (is_float)
+      src.convertTo(frame.depth_, CV_16UC1, mp_.k_depth_scaling_factor_);
+    else
+      src.copyTo(frame.depth_);
+  }
+  else
   {
-    (cv_ptr->image).convertTo(cv_ptr->image, CV_16UC1, mp_.k_depth_scaling_factor_);
+    // an encoding cv_bridge cannot convert costs the frame, not the thread
+    try
+    {
+      cv_bridge::CvImagePtr cv_ptr;
+      cv_ptr = cv_bridge::toCvCopy(frame.image_, frame.image_->encoding);
+      cv_ptr->image.convertTo(frame.depth_, CV_16UC1, is_float ? mp_.k_depth_scaling_factor_ : 1.0);
+    }
+    catch (const std::exception &e)
+    {
+      ROS_WARN_THROTTLE(1.0, "Depth image in %s not converted (%s), frame dropped", img.encoding.c_str(), e.what());
+      frame.image_.reset();
+      return false;
+    }
   }
-  cv_ptr->image.copyTo(md_.depth_image_);
+  frame.image_.reset();
+  return true;
+}
 
-  // std::cout << "depth: " << md_.depth_image_.cols << ", " << md_.depth_image_.rows << std::endl;
+// compressed_depth_image_transport layout: a 12-byte config header, then for
+// rvl the image width and height ahead of the code, or else a 16-bit png
+bool GridMap::decodeCompressedDepth(const sensor_msgs::CompressedImage &img, cv::Mat &depth)
+{
+  const size_t config_size = 12;
+  if (img.format.find("16UC1") == string::npos || img.data.size() < config_size)
+  {
+    ROS_WARN_THROTTLE(1.0, "Unsupported compressed depth format '%s', frame dropped", img.format.c_str());
+    return false;
+  }
+  const uint8_t *data = img.data.data() + config_size;
+  size_t size = img.data.size() - config_size;
 
-  /* get pose */
-  md_.camera_pos_(0) = pose->pose.position.x;
-  md_.camera_pos_(1) = pose->pose.position.y;
-  md_.camera_pos_(2) = pose->pose.position.z;
-  md_.camera_r_m_ = Eigen::Quaterniond(pose->pose.orientation.w, pose->pose.orientation.x,
-                                       pose->pose.orientation.y, pose->pose.orientation.z)
-                        .toRotationMatrix();
-  if (isInMap(md_.camera_pos_))
+  bool decoded;
+  if (img.format.find("rvl") != string::npos)
   {
-    md_.has_odom_ = true;
-    md_.update_num_ += 1;
-    md_.occ_need_update_ = true;
+    uint32_t cols = 0, rows = 0;
+    if (size >= 8)
+    {
+      memcpy(&cols, data, 4);
+      memcpy(&rows, data + 4, 4);
+    }
+    decoded = cols > 0 && rows > 0 && cols <= 16384 && rows <= 16384;
+    if (decoded)
+    {
+      // straight into the frame's depth buffer
+      depth.create(rows, cols, CV_16UC1);
+      decoded = decodeRvl(data + 8, size - 8, depth.ptr<uint16_t>(), rows * cols);
+    }
   }
   else
   {
-    md_.occ_need_update_ = false;
+    depth = cv::imdecode(cv::Mat(1, (int)size, CV_8UC1, (void *)data), cv::IMREAD_UNCHANGED);
+    decoded = !depth.empty() && depth.type() == CV_16UC1;
   }
 
-  md_.flag_use_depth_fusion = true;
+  if (!decoded)
+    ROS_WARN_THROTTLE(1.0, "Corrupt compressed depth image, frame dropped");
+  return decoded;
 }
 
-void GridMap::odomCallback(const nav_msgs::OdometryConstPtr &odom)
+void GridMap::depthPoseCallback(const sensor_msgs::ImageConstPtr &img,
+                                const geometry_msgs::PoseStampedConstPtr &pose)
 {
-  if (md_.has_first_depth_)
-    return;
+  /* keep the image, it is decoded on the mapping thread */
+  DepthFramePtr frame = acquireFrame();
+  frame->image_ = img;
+  frame->stamp_ = img->header.stamp;
+  frame->proj_points_cnt_ = 0;
 
-  md_.camera_pos_(0) = odom->pose.pose.position.x;
-  md_.camera_pos_(1) = odom->pose.pose.position.y;
-  md_.camera_pos_(2) = odom->pose.pose.position.z;
+  /* get pose */
+  frame->camera_pos_(0) = pose->pose.position.x;
+  frame->camera_pos_(1) = pose->pose.position.y;
+  frame->camera_pos_(2) = pose->pose.position.z;
+  frame->camera_r_m_ = Eigen::Quaterniond(pose->pose.orientation.w, pose->pose.orientation.x,
+                                          pose->pose.orientation.y, pose->pose.orientation.z)
+                           .toRotationMatrix();
+  if (isInMap(frame->camera_pos_))
+  {
+    md_.has_odom_ = true;
+    submitFrame(std::move(frame));
+  }
 
+  md_.flag_use_depth_fusion = true;
+}
+
+void GridMap::odomCallback(const nav_msgs::OdometryConstPtr &odom)
+{
+  Eigen::Vector3d pos(odom->pose.pose.position.x, odom->pose.pose.position.y, odom->pose.pose.position.z);
+  Eigen::Quaterniond q(odom->pose.pose.orientation.w, odom->pose.pose.orientation.x,
+                       odom->pose.pose.orientation.y, odom->pose.pose.orientation.z);
+  odom_buffer_.push(odom->header.stamp.toSec(), pos, q);
+  // frames held back for this odometry are retried
+  frame_ring_.poke();
+
+  // md_.camera_pos_ is the raycast stage's, frames carry their own pose
+  md_.odom_pos_ = pos;
   md_.has_odom_ = true;
 }
 
 void GridMap::cloudCallback(const sensor_msgs::PointCloud2ConstPtr &img)
 {
+  if (mp_.cloud_fusion_)
+  {
+    md_.has_cloud_ = true;
+    if (!md_.has_odom_)
+    {
+      std::cout << "no odom!" << std::endl;
+      return;
+    }
 
-  pcl::PointCloud<pcl::PointXYZ> latest_cloud;
-  pcl::fromROSMsg(*img, latest_cloud);
+    // temporal skip, dropped scans never reach the mapping thread
+    if (md_.lidar_scan_cnt_++ % (mp_.lidar_skip_scans_ + 1) != 0)
+      return;
+
+    // the sensor sits at the body origin, its pose is interpolated at the
+    // cloud stamp like a depth camera's
+    DepthFramePtr frame = acquireFrame();
+    frame->cloud_ = img;
+    frame->stamp_ = img->header.stamp;
+    frame->pose_pending_ = true;
+    frame->cam2body_r_ = Eigen::Matrix3d::Identity();
+    frame->cam2body_t_ = Eigen::Vector3d::Zero();
+
+    submitFrame(std::move(frame));
+    md_.flag_use_depth_fusion = true;
+    return;
+  }
 
   md_.has_cloud_ = true;
 
@@ -752,150 +2470,153 @@ void GridMap::cloudCallback(const sensor_msgs::PointCloud2ConstPtr &img)
     return;
   }
 
-  if (latest_cloud.points.size() == 0)
+  // read in place, without a pcl copy of the scan
+  const int point_num = img->width * img->height;
+  if (point_num == 0)
     return;
 
-  if (isnan(md_.camera_pos_(0)) || isnan(md_.camera_pos_(1)) || isnan(md_.camera_pos_(2)))
+  if (isnan(md_.odom_pos_(0)) || isnan(md_.odom_pos_(1)) || isnan(md_.odom_pos_(2)))
     return;
 
-  this->resetBuffer(md_.camera_pos_ - mp_.local_update_range_,
-                    md_.camera_pos_ + mp_.local_update_range_);
-
-  pcl::PointXYZ pt;
-  Eigen::Vector3d p3d, p3d_inf;
-
-  int inf_step = ceil(mp_.obstacles_inflation_ / mp_.resolution_);
-  int inf_step_z = 1;
-
-  double max_x, max_y, max_z, min_x, min_y, min_z;
-
-  min_x = mp_.map_max_boundary_(0);
-  min_y = mp_.map_max_boundary_(1);
-  min_z = mp_.map_max_boundary_(2);
-
-  max_x = mp_.map_min_boundary_(0);
-  max_y = mp_.map_min_boundary_(1);
-  max_z = mp_.map_min_boundary_(2);
-
-  for (size_t i = 0; i < latest_cloud.points.size(); ++i)
+  // voxels seen in the update box replace the ones stored there, older
+  // voxels elsewhere are kept, and only the difference is re-inflated;
+  // voxels just outside the map still inflate into it
+  const Eigen::Vector3i reach = md_.inflate_stencil_id_.back();
+  Eigen::Vector3i reset_min, reset_max, cam_id;
+  posToIndex(md_.odom_pos_ - mp_.local_update_range_, reset_min);
+  posToIndex(md_.odom_pos_ + mp_.local_update_range_, reset_max);
+  reset_min = reset_min.cwiseMax(-reach);
+  reset_max = reset_max.cwiseMin(mp_.map_voxel_num_ + reach - Eigen::Vector3i::Ones());
+  posToIndex(md_.odom_pos_, cam_id);
+
+  vector<int> &occ_next = md_.cloud_occ_next_;
+  occ_next.clear();
+
+  Eigen::Vector3i occ_min = cam_id, occ_max = cam_id, id;
+  sensor_msgs::PointCloud2ConstIterator<float> it_x(*img, "x"), it_y(*img, "y"), it_z(*img, "z");
+  for (int i = 0; i < point_num; ++i, ++it_x, ++it_y, ++it_z)
   {
-    pt = latest_cloud.points[i];
-    p3d(0) = pt.x, p3d(1) = pt.y, p3d(2) = pt.z;
+    if (!std::isfinite(*it_x) || !std::isfinite(*it_y) || !std::isfinite(*it_z))
+      continue;
+    Eigen::Vector3d p3d(*it_x, *it_y, *it_z);
 
     /* point inside update range */
-    Eigen::Vector3d devi = p3d - md_.camera_pos_;
-    Eigen::Vector3i inf_pt;
-
-    if (fabs(devi(0)) < mp_.local_update_range_(0) && fabs(devi(1)) < mp_.local_update_range_(1) &&
-        fabs(devi(2)) < mp_.local_update_range_(2))
-    {
-
-      /* inflate the point */
-      for (int x = -inf_step; x <= inf_step; ++x)
-        for (int y = -inf_step; y <= inf_step; ++y)
-          for (int z = -inf_step_z; z <= inf_step_z; ++z)
-          {
-
-            p3d_inf(0) = pt.x + x * mp_.resolution_;
-            p3d_inf(1) = pt.y + y * mp_.resolution_;
-            p3d_inf(2) = pt.z + z * mp_.resolution_;
-
-            max_x = max(max_x, p3d_inf(0));
-            max_y = max(max_y, p3d_inf(1));
-            max_z = max(max_z, p3d_inf(2));
-
-            min_x = min(min_x, p3d_inf(0));
-            min_y = min(min_y, p3d_inf(1));
-            min_z = min(min_z, p3d_inf(2));
-
-            posToIndex(p3d_inf, inf_pt);
-
-            if (!isInMap(inf_pt))
-              continue;
+    Eigen::Vector3d devi = p3d - md_.odom_pos_;
+    if (fabs(devi(0)) >= mp_.local_update_range_(0) || fabs(devi(1)) >= mp_.local_update_range_(1) ||
+        fabs(devi(2)) >= mp_.local_update_range_(2))
+      continue;
 
-            int idx_inf = toAddress(inf_pt);
+    posToIndex(p3d, id);
+    if (!isInCloudGrid(id))
+      continue;
 
-            md_.occupancy_buffer_inflate_[idx_inf] = 1;
-          }
-    }
+    occ_min = occ_min.cwiseMin(id);
+    occ_max = occ_max.cwiseMax(id);
+    occ_next.push_back(cloudAddress(id));
   }
 
-  min_x = min(min_x, md_.camera_pos_(0));
-  min_y = min(min_y, md_.camera_pos_(1));
-  min_z = min(min_z, md_.camera_pos_(2));
+  // resets and fusion write the inflated map too
+  std::lock_guard<std::mutex> lock(inflate_mutex_);
+  for (int adr : md_.cloud_occ_)
+  {
+    cloudIndex(adr, id);
+    if ((id.array() < reset_min.array()).any() || (id.array() > reset_max.array()).any())
+      occ_next.push_back(adr);
+  }
 
-  max_x = max(max_x, md_.camera_pos_(0));
-  max_y = max(max_y, md_.camera_pos_(1));
-  max_z = max(max_z, md_.camera_pos_(2));
+  sort(occ_next.begin(), occ_next.end());
+  occ_next.erase(unique(occ_next.begin(), occ_next.end()), occ_next.end());
 
-  max_z = max(max_z, mp_.ground_height_);
+  // walk both sorted sets, a voxel in only one of them changed
+  Eigen::Vector3i dirty_min = mp_.map_voxel_num_, dirty_max = Eigen::Vector3i::Constant(-1);
+  const vector<int> &occ_prev = md_.cloud_occ_;
+  size_t i = 0, j = 0;
+  while (i < occ_prev.size() || j < occ_next.size())
+  {
+    int adr, delta;
+    if (j == occ_next.size() || (i < occ_prev.size() && occ_prev[i] < occ_next[j]))
+      adr = occ_prev[i++], delta = -1;
+    else if (i == occ_prev.size() || occ_next[j] < occ_prev[i])
+      adr = occ_next[j++], delta = 1;
+    else
+    {
+      ++i, ++j;
+      continue;
+    }
 
-  posToIndex(Eigen::Vector3d(max_x, max_y, max_z), md_.local_bound_max_);
-  posToIndex(Eigen::Vector3d(min_x, min_y, min_z), md_.local_bound_min_);
+    inflateCloudVoxel(adr, delta);
+    cloudIndex(adr, id);
+    dirty_min = dirty_min.cwiseMin(id);
+    dirty_max = dirty_max.cwiseMax(id);
+  }
+  md_.cloud_occ_.swap(occ_next);
 
-  boundIndex(md_.local_bound_min_);
-  boundIndex(md_.local_bound_max_);
+  Eigen::Vector3i bound_min = occ_min - reach;
+  Eigen::Vector3i bound_max = occ_max + reach;
+  bound_max(2) = max(bound_max(2), (int)floor((mp_.ground_height_ - mp_.map_origin_(2)) * mp_.resolution_inv_));
+  boundIndex(bound_min);
+  boundIndex(bound_max);
 
+  if ((dirty_min.array() <= dirty_max.array()).all())
+  {
+    dirty_min -= reach;
+    dirty_max += reach;
+    boundIndex(dirty_min);
+    boundIndex(dirty_max);
+    publishInflateVersion(dirty_min, dirty_max, bound_min, bound_max);
+  }
 }
 
 void GridMap::publishMap()
 {
 
-  if (map_pub_.getNumSubscribers() <= 0)
+  const int subs = map_pub_.getNumSubscribers();
+  if (subs <= 0)
     return;
 
-  pcl::PointXYZ pt;
-  pcl::PointCloud<pcl::PointXYZ> cloud;
+  // the shown box only moves with a new version, which carries it
+  VersionPin pin = pinVersion();
+  if (pin.version() == md_.map_pub_version_ && subs <= md_.map_pub_subs_)
+  {
+    md_.map_pub_subs_ = subs;
+    return;
+  }
+  md_.map_pub_version_ = pin.version();
+  md_.map_pub_subs_ = subs;
 
-  Eigen::Vector3i min_cut = md_.local_bound_min_;
-  Eigen::Vector3i max_cut = md_.local_bound_max_;
+  Eigen::Vector3i min_cut = pin.version_->bound_min_;
+  Eigen::Vector3i max_cut = pin.version_->bound_max_;
 
   int lmm = mp_.local_map_margin_ / 2;
   min_cut -= Eigen::Vector3i(lmm, lmm, lmm);
   max_cut += Eigen::Vector3i(lmm, lmm, lmm);
 
-  boundIndex(min_cut);
-  boundIndex(max_cut);
-
-  for (int x = min_cut(0); x <= max_cut(0); ++x)
-    for (int y = min_cut(1); y <= max_cut(1); ++y)
-      for (int z = min_cut(2); z <= max_cut(2); ++z)
-      {
-        if (md_.occupancy_buffer_[toAddress(x, y, z)] < mp_.min_occupancy_log_)
-          continue;
-
-        Eigen::Vector3d pos;
-        indexToPos(Eigen::Vector3i(x, y, z), pos);
-        if (pos(2) > mp_.visualization_truncate_height_)
-          continue;
-
-        pt.x = pos(0);
-        pt.y = pos(1);
-        pt.z = pos(2);
-        cloud.push_back(pt);
-      }
-
-  cloud.width = cloud.points.size();
-  cloud.height = 1;
-  cloud.is_dense = true;
-  cloud.header.frame_id = mp_.frame_id_;
-  sensor_msgs::PointCloud2 cloud_msg;
-
-  pcl::toROSMsg(cloud, cloud_msg);
+  // from the pinned version, which stays as it is between the two passes
+  const char *state = pin.version_->state_.data();
+  static thread_local sensor_msgs::PointCloud2 cloud_msg;
+  fillVoxelCloud(min_cut, max_cut, [state](int adr) { return state[adr] == VOXEL_OCCUPIED; }, cloud_msg);
   map_pub_.publish(cloud_msg);
 }
 
 void GridMap::publishMapInflate(bool all_info)
 {
 
-  if (map_inf_pub_.getNumSubscribers() <= 0)
+  const int subs = map_inf_pub_.getNumSubscribers();
+  if (subs <= 0)
     return;
 
-  pcl::PointXYZ pt;
-  pcl::PointCloud<pcl::PointXYZ> cloud;
+  VersionPin pin = pinVersion();
+  if (pin.version() == md_.map_inf_pub_version_ && subs <= md_.map_inf_pub_subs_)
+  {
+    md_.map_inf_pub_subs_ = subs;
+    return;
+  }
+  md_.map_inf_pub_version_ = pin.version();
+  md_.map_inf_pub_subs_ = subs;
+  const char *inflate = inflateBuffer();
 
-  Eigen::Vector3i min_cut = md_.local_bound_min_;
-  Eigen::Vector3i max_cut = md_.local_bound_max_;
+  Eigen::Vector3i min_cut = pin.version_->bound_min_;
+  Eigen::Vector3i max_cut = pin.version_->bound_max_;
 
   if (all_info)
   {
@@ -904,37 +2625,257 @@ void GridMap::publishMapInflate(bool all_info)
     max_cut += Eigen::Vector3i(lmm, lmm, lmm);
   }
 
+  static thread_local sensor_msgs::PointCloud2 cloud_msg;
+  fillVoxelCloud(min_cut, max_cut, [inflate](int adr) { return inflate[adr] != 0; }, cloud_msg);
+  map_inf_pub_.publish(cloud_msg);
+
+  // ROS_INFO("pub map");
+}
+
+// columns of the box are counted first, so each one writes its points at a
+// known offset and the scan runs in parallel without a pcl copy; occupied
+// must read a snapshot, a voxel that turns occupied between the passes would
+// write past its column
+template <typename Occupied>
+void GridMap::fillVoxelCloud(Eigen::Vector3i min_cut, Eigen::Vector3i max_cut, Occupied occupied,
+                             sensor_msgs::PointCloud2 &msg)
+{
   boundIndex(min_cut);
   boundIndex(max_cut);
 
-  for (int x = min_cut(0); x <= max_cut(0); ++x)
-    for (int y = min_cut(1); y <= max_cut(1); ++y)
-      for (int z = min_cut(2); z <= max_cut(2); ++z)
+  // highest voxel whose centre is not above the truncation height
+  const double res = mp_.resolution_;
+  const int z_top = floor((mp_.visualization_truncate_height_ - mp_.map_origin_(2)) / res - 0.5);
+  max_cut(2) = min(max_cut(2), z_top);
+
+  const int nx = max_cut(0) - min_cut(0) + 1, ny = max_cut(1) - min_cut(1) + 1;
+  const int columns = max_cut(2) >= min_cut(2) ? nx * ny : 0;
+
+  // the workers share this thread's offsets through a plain pointer
+  static thread_local vector<int> column_offsets;
+  column_offsets.assign(columns + 1, 0);
+  int *column_start = column_offsets.data();
+
+#pragma omp parallel for schedule(dynamic, 64) num_threads(mp_.visualization_threads_)
+  for (int c = 0; c < columns; ++c)
+  {
+    int adr = toAddress(Eigen::Vector3i(min_cut(0) + c / ny, min_cut(1) + c % ny, min_cut(2)));
+    int count = 0;
+    for (int z = min_cut(2); z <= max_cut(2); ++z, ++adr)
+      count += occupied(adr) ? 1 : 0;
+    column_start[c + 1] = count;
+  }
+  std::partial_sum(column_start, column_start + columns + 1, column_start);
+  const int point_num = column_start[columns];
+
+  if (msg.fields.size() != 3)
+  {
+    const char *names[3] = { "x", "y", "z" };
+    msg.fields.resize(3);
+    for (int i = 0; i < 3; ++i)
+    {
+      msg.fields[i].name = names[i];
+      msg.fields[i].offset = 4 * i;
+      msg.fields[i].datatype = sensor_msgs::PointField::FLOAT32;
+      msg.fields[i].count = 1;
+    }
+  }
+  msg.header.frame_id = mp_.frame_id_;
+  msg.height = 1;
+  msg.width = point_num;
+  msg.is_bigendian = false;
+  msg.point_step = 3 * sizeof(float);
+  msg.row_step = msg.point_step * point_num;
+  msg.is_dense = true;
+  // the buffer keeps its capacity from one publication to the next
+  msg.data.resize(msg.row_step);
+
+  uint8_t *data = msg.data.data();
+#pragma omp parallel for schedule(dynamic, 64) num_threads(mp_.visualization_threads_)
+  for (int c = 0; c < columns; ++c)
+  {
+    if (column_start[c + 1] == column_start[c])
+      continue;
+
+    const int x = min_cut(0) + c / ny, y = min_cut(1) + c % ny;
+    float point[3] = { float((x + 0.5) * res + mp_.map_origin_(0)), float((y + 0.5) * res + mp_.map_origin_(1)), 0.0f };
+    float *out = reinterpret_cast<float *>(data) + 3 * column_start[c];
+    int adr = toAddress(Eigen::Vector3i(x, y, min_cut(2)));
+    for (int z = min_cut(2); z <= max_cut(2); ++z, ++adr)
+    {
+      if (!occupied(adr))
+        continue;
+      point[2] = (z + 0.5) * res + mp_.map_origin_(2);
+      memcpy(out, point, sizeof(point));
+      out += 3;
+    }
+  }
+}
+
+void GridMap::publishMapDelta()
+{
+  const int msg_subs = map_delta_pub_.getNumSubscribers();
+  const int stream_subs = map_stream_pub_.getNumSubscribers();
+  const bool to_msg = msg_subs > 0;
+  const bool to_stream = stream_subs > 0;
+
+  // whoever subscribes, first or next to those already there, starts from a
+  // keyframe; the box keeps growing meanwhile, so the sent map still catches
+  // up on everything later
+  if (msg_subs > md_.delta_subs_)
+    md_.delta_synced_ = false;
+  if (stream_subs > md_.stream_subs_)
+    md_.stream_synced_ = false;
+  md_.delta_subs_ = msg_subs;
+  md_.stream_subs_ = stream_subs;
+  if (!to_msg && !to_stream)
+    return;
+
+  Eigen::Vector3i min_id, max_id;
+  uint64_t version;
+  std::unique_lock<std::mutex> lock(delta_mutex_);
+  min_id = md_.delta_dirty_min_;
+  max_id = md_.delta_dirty_max_;
+  version = md_.delta_dirty_version_;
+  md_.delta_dirty_min_ = mp_.map_voxel_num_;
+  md_.delta_dirty_max_ = -Eigen::Vector3i::Ones();
+
+  // no version is stored while the lock is held, so the pinned one is the
+  // one the box was last grown for
+  VersionPin pin = pinVersion();
+  lock.unlock();
+  const char *inflate = inflateBuffer();
+
+  md_.delta_added_.clear();
+  md_.delta_removed_.clear();
+  for (int x = min_id(0); x <= max_id(0); ++x)
+    for (int y = min_id(1); y <= max_id(1); ++y)
+    {
+      int adr = toAddress(x, y, min_id(2));
+      for (int z = min_id(2); z <= max_id(2); ++z, ++adr)
       {
-        if (md_.occupancy_buffer_inflate_[toAddress(x, y, z)] == 0)
+        if (inflate[adr] == md_.delta_state_[adr])
           continue;
+        md_.delta_state_[adr] = inflate[adr];
+        (inflate[adr] ? md_.delta_added_ : md_.delta_removed_).push_back(adr);
+      }
+    }
 
-        Eigen::Vector3d pos;
-        indexToPos(Eigen::Vector3i(x, y, z), pos);
-        if (pos(2) > mp_.visualization_truncate_height_)
-          continue;
+  const ros::Time now = ros::Time::now();
+  if (to_msg)
+    publishDeltaMsg(version, now);
+  if (to_stream)
+    publishMapChunk(version, now);
+}
 
-        pt.x = pos(0);
-        pt.y = pos(1);
-        pt.z = pos(2);
-        cloud.push_back(pt);
-      }
+void GridMap::publishDeltaMsg(uint64_t version, const ros::Time &now)
+{
+  static thread_local plan_env::MapDelta msg;
+  msg.keyframe = !md_.delta_synced_ ||
+                 (now - md_.delta_keyframe_time_).toSec() > mp_.map_delta_keyframe_interval_;
 
-  cloud.width = cloud.points.size();
-  cloud.height = 1;
-  cloud.is_dense = true;
-  cloud.header.frame_id = mp_.frame_id_;
-  sensor_msgs::PointCloud2 cloud_msg;
+  if (msg.keyframe)
+  {
+    msg.added.clear();
+    msg.removed.clear();
+    const int buffer_size = md_.delta_state_.size();
+    for (int adr = 0; adr < buffer_size; ++adr)
+      if (md_.delta_state_[adr])
+        msg.added.push_back(adr);
+    md_.delta_keyframe_time_ = now;
+  }
+  else
+  {
+    // a version that changed nothing is not worth a message
+    if (md_.delta_added_.empty() && md_.delta_removed_.empty())
+      return;
+    msg.added = md_.delta_added_;
+    msg.removed = md_.delta_removed_;
+  }
 
-  pcl::toROSMsg(cloud, cloud_msg);
-  map_inf_pub_.publish(cloud_msg);
+  msg.header.stamp = now;
+  msg.header.frame_id = mp_.frame_id_;
+  msg.base_version = msg.keyframe ? 0 : md_.delta_version_;
+  msg.version = version;
+  msg.resolution = mp_.resolution_;
+  for (int i = 0; i < 3; ++i)
+  {
+    msg.origin[i] = mp_.map_origin_(i);
+    msg.size[i] = mp_.map_voxel_num_(i);
+  }
+  map_delta_pub_.publish(msg);
 
-  // ROS_INFO("pub map");
+  md_.delta_version_ = version;
+  md_.delta_synced_ = true;
+}
+
+void GridMap::publishMapChunk(uint64_t version, const ros::Time &now)
+{
+  map_codec::MapChunkHeader header;
+  header.keyframe = !md_.stream_synced_ ||
+                    (now - md_.stream_keyframe_time_).toSec() > mp_.map_stream_keyframe_interval_;
+  header.version = version;
+  header.base_version = header.keyframe ? 0 : md_.stream_version_;
+  header.resolution = mp_.resolution_;
+  for (int i = 0; i < 3; ++i)
+  {
+    header.size[i] = mp_.map_voxel_num_(i);
+    header.origin[i] = mp_.map_origin_(i);
+  }
+
+  // a keyframe holds every brick with an inflated voxel, a delta the bricks
+  // any voxel changed in
+  vector<int> &bricks = md_.stream_bricks_;
+  bricks.clear();
+  auto list_brick = [this, &header, &bricks](int adr) {
+    int brick = map_codec::brickOf(header.size, adr);
+    if (!md_.stream_brick_listed_[brick])
+    {
+      md_.stream_brick_listed_[brick] = 1;
+      bricks.push_back(brick);
+    }
+  };
+
+  if (header.keyframe)
+  {
+    const int buffer_size = md_.delta_state_.size();
+    for (int adr = 0; adr < buffer_size; ++adr)
+      if (md_.delta_state_[adr])
+        list_brick(adr);
+    md_.stream_keyframe_time_ = now;
+  }
+  else
+  {
+    for (int adr : md_.delta_added_)
+      list_brick(adr);
+    for (int adr : md_.delta_removed_)
+      list_brick(adr);
+    if (bricks.empty())
+      return;
+  }
+
+  for (int brick : bricks)
+    md_.stream_brick_listed_[brick] = 0;
+  sort(bricks.begin(), bricks.end());
+
+  static thread_local plan_env::MapChunk msg;
+  md_.stream_encoder_.encode(header, md_.delta_state_.data(), bricks, msg.data, mp_.map_stream_compression_);
+  msg.header.stamp = now;
+  msg.header.frame_id = mp_.frame_id_;
+  map_stream_pub_.publish(msg);
+
+  if (md_.stream_bytes_ == 0)
+    md_.stream_start_time_ = now;
+  md_.stream_bytes_ += msg.data.size();
+  md_.stream_version_ = version;
+  md_.stream_synced_ = true;
+
+  if (mp_.show_occ_time_)
+  {
+    double elapsed = (now - md_.stream_start_time_).toSec();
+    ROS_WARN("Map stream: %s of %d bricks, %d bytes, %.1f kB/s on average", header.keyframe ? "keyframe" : "delta",
+             (int)bricks.size(), (int)msg.data.size(), elapsed > 0 ? md_.stream_bytes_ / elapsed / 1000.0 : 0.0);
+  }
 }
 
 bool GridMap::odomValid() { return md_.has_odom_; }
@@ -983,20 +2924,44 @@ void GridMap::depthOdomCallback(const sensor_msgs::ImageConstPtr &img,
   body2world(3, 3) = 1.0;
 
   Eigen::Matrix4d cam_T = body2world * md_.cam2body_;
-  md_.camera_pos_(0) = cam_T(0, 3);
-  md_.camera_pos_(1) = cam_T(1, 3);
-  md_.camera_pos_(2) = cam_T(2, 3);
-  md_.camera_r_m_ = cam_T.block<3, 3>(0, 0);
+  DepthFramePtr frame = acquireFrame();
+  frame->camera_pos_(0) = cam_T(0, 3);
+  frame->camera_pos_(1) = cam_T(1, 3);
+  frame->camera_pos_(2) = cam_T(2, 3);
+  frame->camera_r_m_ = cam_T.block<3, 3>(0, 0);
+
+  /* keep the image, it is decoded on the mapping thread */
+  frame->image_ = img;
+  frame->stamp_ = img->header.stamp;
+  frame->proj_points_cnt_ = 0;
+
+  submitFrame(std::move(frame));
+  md_.flag_use_depth_fusion = true;
+}
 
-  /* get depth image */
-  cv_bridge::CvImagePtr cv_ptr;
-  cv_ptr = cv_bridge::toCvCopy(img, img->encoding);
-  if (img->encoding == sensor_msgs::image_encodings::TYPE_32FC1)
-  {
-    (cv_ptr->image).convertTo(cv_ptr->image, CV_16UC1, mp_.k_depth_scaling_factor_);
-  }
-  cv_ptr->image.copyTo(md_.depth_image_);
+void GridMap::depthCallback(const sensor_msgs::ImageConstPtr &img)
+{
+  DepthFramePtr frame = acquireFrame();
+  frame->image_ = img;
+  frame->stamp_ = img->header.stamp;
+  submitPosePendingFrame(std::move(frame));
+}
+
+void GridMap::depthCompressedCallback(const sensor_msgs::CompressedImageConstPtr &img)
+{
+  DepthFramePtr frame = acquireFrame();
+  frame->compressed_ = img;
+  frame->stamp_ = img->header.stamp;
+  submitPosePendingFrame(std::move(frame));
+}
+
+// the pose is interpolated once the mapping thread takes the frame
+void GridMap::submitPosePendingFrame(DepthFramePtr frame)
+{
+  frame->pose_pending_ = true;
+  frame->cam2body_r_ = md_.cam2body_.block<3, 3>(0, 0);
+  frame->cam2body_t_ = md_.cam2body_.block<3, 1>(0, 3);
 
-  md_.occ_need_update_ = true;
+  submitFrame(std::move(frame));
   md_.flag_use_depth_fusion = true;
 }
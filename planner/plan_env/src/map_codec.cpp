@@ -0,0 +1,295 @@
+#include <cstring>
+#include <plan_env/map_codec.h>
+#include <zlib.h>
+
+namespace map_codec {
+
+namespace {
+
+const uint32_t CHUNK_MAGIC = 0x434d4550;  // "PEMC"
+const uint8_t CHUNK_FORMAT = 1;
+const size_t HEADER_BYTES = 72;
+
+enum { BRICK_EMPTY = 0, BRICK_FULL = 1, BRICK_RUNS = 2, BRICK_RAW = 3 };
+enum { BRICK_WORDS = BRICK_VOXELS / 64 };
+
+void putVarint(std::vector<uint8_t>& out, uint32_t value) {
+  while (value >= 0x80) {
+    out.push_back(uint8_t(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(uint8_t(value));
+}
+
+bool getVarint(const uint8_t*& data, const uint8_t* end, uint32_t& value) {
+  value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (data == end) return false;
+    uint8_t byte = *data++;
+    value |= uint32_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+int varintBytes(uint32_t value) {
+  int bytes = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    bytes++;
+  }
+  return bytes;
+}
+
+template <typename T>
+void putRaw(uint8_t*& out, const T& value) {
+  memcpy(out, &value, sizeof(T));
+  out += sizeof(T);
+}
+
+template <typename T>
+void getRaw(const uint8_t*& data, T& value) {
+  memcpy(&value, data, sizeof(T));
+  data += sizeof(T);
+}
+
+// voxels of a brick in bit order, x major and z fastest like the grid, so
+// a column of the brick is a run of 8 bits
+void brickOrigin(const int size[3], int brick, int origin[3]) {
+  int bricks[3];
+  brickGrid(size, bricks);
+  origin[0] = brick / (bricks[1] * bricks[2]) * BRICK_EDGE;
+  origin[1] = brick / bricks[2] % bricks[1] * BRICK_EDGE;
+  origin[2] = brick % bricks[2] * BRICK_EDGE;
+}
+
+void readBrick(const int size[3], const char* occupancy, int brick, uint64_t bits[BRICK_WORDS]) {
+  int org[3];
+  brickOrigin(size, brick, org);
+  memset(bits, 0, BRICK_WORDS * sizeof(uint64_t));
+  for (int x = 0; x < BRICK_EDGE && org[0] + x < size[0]; ++x)
+    for (int y = 0; y < BRICK_EDGE && org[1] + y < size[1]; ++y) {
+      const char* column = occupancy + ((org[0] + x) * size[1] + org[1] + y) * size[2];
+      for (int z = 0; z < BRICK_EDGE && org[2] + z < size[2]; ++z)
+        if (column[org[2] + z]) {
+          int bit = (x * BRICK_EDGE + y) * BRICK_EDGE + z;
+          bits[bit >> 6] |= uint64_t(1) << (bit & 63);
+        }
+    }
+}
+
+void writeBrick(const int size[3], char* occupancy, int brick, const uint64_t bits[BRICK_WORDS]) {
+  int org[3];
+  brickOrigin(size, brick, org);
+  for (int x = 0; x < BRICK_EDGE && org[0] + x < size[0]; ++x)
+    for (int y = 0; y < BRICK_EDGE && org[1] + y < size[1]; ++y) {
+      char* column = occupancy + ((org[0] + x) * size[1] + org[1] + y) * size[2];
+      for (int z = 0; z < BRICK_EDGE && org[2] + z < size[2]; ++z) {
+        int bit = (x * BRICK_EDGE + y) * BRICK_EDGE + z;
+        column[org[2] + z] = (bits[bit >> 6] >> (bit & 63)) & 1;
+      }
+    }
+}
+
+inline bool getBit(const uint64_t bits[BRICK_WORDS], int bit) {
+  return (bits[bit >> 6] >> (bit & 63)) & 1;
+}
+
+// alternating runs of clear and set bits, starting with clear ones
+void putBrick(std::vector<uint8_t>& out, const uint64_t bits[BRICK_WORDS]) {
+  bool empty = true, full = true;
+  for (int i = 0; i < BRICK_WORDS; ++i) {
+    empty &= bits[i] == 0;
+    full &= bits[i] == ~uint64_t(0);
+  }
+  if (empty || full) {
+    out.push_back(empty ? BRICK_EMPTY : BRICK_FULL);
+    return;
+  }
+
+  int run_bytes = 0;
+  bool value = false;
+  int run = 0;
+  for (int bit = 0; bit < BRICK_VOXELS; ++bit) {
+    if (getBit(bits, bit) != value) {
+      run_bytes += varintBytes(run);
+      value = !value;
+      run = 0;
+    }
+    run++;
+  }
+  run_bytes += varintBytes(run);
+
+  if (run_bytes >= BRICK_VOXELS / 8) {
+    out.push_back(BRICK_RAW);
+    size_t n = out.size();
+    out.resize(n + BRICK_VOXELS / 8);
+    memcpy(&out[n], bits, BRICK_VOXELS / 8);
+    return;
+  }
+
+  out.push_back(BRICK_RUNS);
+  value = false;
+  run = 0;
+  for (int bit = 0; bit < BRICK_VOXELS; ++bit) {
+    if (getBit(bits, bit) != value) {
+      putVarint(out, run);
+      value = !value;
+      run = 0;
+    }
+    run++;
+  }
+  putVarint(out, run);
+}
+
+bool getBrick(const uint8_t*& data, const uint8_t* end, uint64_t bits[BRICK_WORDS]) {
+  if (data == end) return false;
+  uint8_t mode = *data++;
+
+  if (mode == BRICK_EMPTY || mode == BRICK_FULL) {
+    for (int i = 0; i < BRICK_WORDS; ++i) bits[i] = mode == BRICK_FULL ? ~uint64_t(0) : 0;
+    return true;
+  }
+
+  if (mode == BRICK_RAW) {
+    if (end - data < BRICK_VOXELS / 8) return false;
+    memcpy(bits, data, BRICK_VOXELS / 8);
+    data += BRICK_VOXELS / 8;
+    return true;
+  }
+
+  if (mode != BRICK_RUNS) return false;
+  memset(bits, 0, BRICK_WORDS * sizeof(uint64_t));
+  bool value = false;
+  uint32_t bit = 0, run;
+  while (bit < BRICK_VOXELS) {
+    if (!getVarint(data, end, run) || run > BRICK_VOXELS - bit) return false;
+    if (value)
+      for (uint32_t b = bit; b < bit + run; ++b) bits[b >> 6] |= uint64_t(1) << (b & 63);
+    bit += run;
+    value = !value;
+  }
+  return true;
+}
+
+}  // namespace
+
+void brickGrid(const int size[3], int bricks[3]) {
+  for (int i = 0; i < 3; ++i) bricks[i] = (size[i] + BRICK_EDGE - 1) >> BRICK_LOG2;
+}
+
+int brickCount(const int size[3]) {
+  int bricks[3];
+  brickGrid(size, bricks);
+  return bricks[0] * bricks[1] * bricks[2];
+}
+
+int brickOf(const int size[3], int adr) {
+  int bricks[3];
+  brickGrid(size, bricks);
+  int z = adr % size[2], y = adr / size[2] % size[1], x = adr / (size[1] * size[2]);
+  return ((x >> BRICK_LOG2) * bricks[1] + (y >> BRICK_LOG2)) * bricks[2] + (z >> BRICK_LOG2);
+}
+
+void MapChunkEncoder::encode(const MapChunkHeader& header, const char* occupancy, const std::vector<int>& bricks,
+                             std::vector<uint8_t>& out, int level) {
+  // bricks by gap to the previous one, which stays small along a dirty box
+  payload_.clear();
+  putVarint(payload_, bricks.size());
+  int previous = -1;
+  uint64_t bits[BRICK_WORDS];
+  for (int brick : bricks) {
+    putVarint(payload_, brick - previous - 1);
+    previous = brick;
+    readBrick(header.size, occupancy, brick, bits);
+    putBrick(payload_, bits);
+  }
+
+  uLongf packed = compressBound(payload_.size());
+  out.resize(HEADER_BYTES + packed);
+  uint8_t* head = out.data();
+  putRaw(head, CHUNK_MAGIC);
+  putRaw(head, CHUNK_FORMAT);
+  putRaw(head, uint8_t(header.keyframe ? 1 : 0));
+  putRaw(head, uint8_t(BRICK_LOG2));
+  putRaw(head, uint8_t(0));
+  putRaw(head, header.version);
+  putRaw(head, header.base_version);
+  for (int i = 0; i < 3; ++i) putRaw(head, int32_t(header.size[i]));
+  putRaw(head, header.resolution);
+  for (int i = 0; i < 3; ++i) putRaw(head, header.origin[i]);
+  putRaw(head, uint32_t(payload_.size()));
+
+  if (compress2(head, &packed, payload_.data(), payload_.size(), level) != Z_OK) packed = 0;
+  out.resize(HEADER_BYTES + packed);
+}
+
+bool MapChunkDecoder::apply(const uint8_t* data, size_t size) {
+  if (size < HEADER_BYTES) return false;
+
+  uint32_t magic, payload_size;
+  uint8_t format, flags, brick_log2, reserved;
+  MapChunkHeader header;
+  const uint8_t* head = data;
+  getRaw(head, magic);
+  getRaw(head, format);
+  getRaw(head, flags);
+  getRaw(head, brick_log2);
+  getRaw(head, reserved);
+  getRaw(head, header.version);
+  getRaw(head, header.base_version);
+  for (int i = 0; i < 3; ++i) {
+    int32_t n;
+    getRaw(head, n);
+    header.size[i] = n;
+  }
+  getRaw(head, header.resolution);
+  for (int i = 0; i < 3; ++i) getRaw(head, header.origin[i]);
+  getRaw(head, payload_size);
+  header.keyframe = flags & 1;
+
+  if (magic != CHUNK_MAGIC || format != CHUNK_FORMAT || brick_log2 != BRICK_LOG2) return false;
+  for (int i = 0; i < 3; ++i)
+    if (header.size[i] <= 0) return false;
+  if (double(header.size[0]) * header.size[1] * header.size[2] > 0x7fffffff) return false;
+  // no brick takes more than its raw bits and a few bytes of gap and mode
+  if (payload_size > size_t(brickCount(header.size)) * (BRICK_VOXELS / 8 + 6) + 5) return false;
+
+  if (!header.keyframe) {
+    if (!synced_ || header.base_version != header_.version) return false;
+    for (int i = 0; i < 3; ++i)
+      if (header.size[i] != header_.size[i]) return false;
+  }
+
+  payload_.resize(payload_size);
+  uLongf unpacked = payload_size;
+  if (uncompress(payload_.data(), &unpacked, data + HEADER_BYTES, size - HEADER_BYTES) != Z_OK ||
+      unpacked != payload_size)
+    return false;
+
+  if (header.keyframe) occupancy_.assign(size_t(header.size[0]) * header.size[1] * header.size[2], 0);
+  // a chunk that breaks off halfway leaves the map between two versions
+  synced_ = applyPayload(header);
+  if (synced_) header_ = header;
+  return synced_;
+}
+
+bool MapChunkDecoder::applyPayload(const MapChunkHeader& header) {
+  const uint8_t* data = payload_.data();
+  const uint8_t* end = data + payload_.size();
+  const int brick_num = brickCount(header.size);
+
+  uint32_t count, gap;
+  if (!getVarint(data, end, count)) return false;
+  int brick = -1;
+  uint64_t bits[BRICK_WORDS];
+  for (uint32_t i = 0; i < count; ++i) {
+    if (!getVarint(data, end, gap) || gap >= uint32_t(brick_num - brick - 1)) return false;
+    brick += gap + 1;
+    if (!getBrick(data, end, bits)) return false;
+    writeBrick(header.size, occupancy_.data(), brick, bits);
+  }
+  return data == end;
+}
+
+}  // namespace map_codec
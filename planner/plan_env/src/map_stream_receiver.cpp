@@ -0,0 +1,125 @@
+// Ground side of grid_map/occupancy_stream: rebuilds the map from the
+// compressed chunks, republishes it as a cloud for rviz, and reports what
+// the stream costs on the link against sending the same map as xyz points.
+//
+//   rosrun plan_env map_stream_receiver map_stream:=/<planner>/grid_map/occupancy_stream
+
+#include <cstring>
+#include <plan_env/MapChunk.h>
+#include <plan_env/map_codec.h>
+#include <ros/ros.h>
+#include <sensor_msgs/PointCloud2.h>
+
+namespace
+{
+map_codec::MapChunkDecoder decoder;
+ros::Publisher cloud_pub;
+std::string frame_id;
+
+// since the last report
+size_t chunk_bytes = 0;
+int chunk_num = 0, rejected_num = 0;
+ros::Time report_time;
+
+void publishCloud()
+{
+  const map_codec::MapChunkHeader &grid = decoder.header();
+  const std::vector<char> &occupancy = decoder.occupancy();
+
+  static sensor_msgs::PointCloud2 cloud;
+  if (cloud.fields.size() != 3)
+  {
+    const char *names[3] = { "x", "y", "z" };
+    cloud.fields.resize(3);
+    for (int i = 0; i < 3; ++i)
+    {
+      cloud.fields[i].name = names[i];
+      cloud.fields[i].offset = 4 * i;
+      cloud.fields[i].datatype = sensor_msgs::PointField::FLOAT32;
+      cloud.fields[i].count = 1;
+    }
+  }
+
+  cloud.data.clear();
+  float point[3];
+  for (int x = 0; x < grid.size[0]; ++x)
+    for (int y = 0; y < grid.size[1]; ++y)
+    {
+      const char *column = &occupancy[(size_t(x) * grid.size[1] + y) * grid.size[2]];
+      for (int z = 0; z < grid.size[2]; ++z)
+      {
+        if (!column[z])
+          continue;
+        point[0] = (x + 0.5) * grid.resolution + grid.origin[0];
+        point[1] = (y + 0.5) * grid.resolution + grid.origin[1];
+        point[2] = (z + 0.5) * grid.resolution + grid.origin[2];
+        size_t n = cloud.data.size();
+        cloud.data.resize(n + sizeof(point));
+        memcpy(&cloud.data[n], point, sizeof(point));
+      }
+    }
+
+  cloud.header.stamp = ros::Time::now();
+  cloud.header.frame_id = frame_id;
+  cloud.height = 1;
+  cloud.point_step = sizeof(point);
+  cloud.width = cloud.data.size() / cloud.point_step;
+  cloud.row_step = cloud.data.size();
+  cloud.is_bigendian = false;
+  cloud.is_dense = true;
+  cloud_pub.publish(cloud);
+}
+
+void chunkCallback(const plan_env::MapChunkConstPtr &chunk)
+{
+  chunk_bytes += chunk->data.size();
+  chunk_num++;
+  frame_id = chunk->header.frame_id;
+
+  // a delta that misses its base is dropped until the next keyframe
+  if (!decoder.apply(chunk->data.data(), chunk->data.size()))
+  {
+    rejected_num++;
+    return;
+  }
+  if (cloud_pub.getNumSubscribers() > 0)
+    publishCloud();
+}
+
+void reportCallback(const ros::TimerEvent & /*event*/)
+{
+  const ros::Time now = ros::Time::now();
+  const double elapsed = (now - report_time).toSec();
+  report_time = now;
+  if (elapsed <= 0)
+    return;
+
+  size_t occupied = 0;
+  for (char voxel : decoder.occupancy())
+    occupied += voxel != 0;
+
+  ROS_INFO("Map stream: %.2f kB/s in %d chunks, %d rejected, version %lu, %lu voxels (%.1f kB as xyz points)",
+           chunk_bytes / elapsed / 1000.0, chunk_num, rejected_num, (unsigned long)decoder.header().version,
+           (unsigned long)occupied, occupied * 12 / 1000.0);
+  chunk_bytes = 0;
+  chunk_num = rejected_num = 0;
+}
+}  // namespace
+
+int main(int argc, char **argv)
+{
+  ros::init(argc, argv, "map_stream_receiver");
+  ros::NodeHandle node;
+  ros::NodeHandle private_node("~");
+
+  double report_period;
+  private_node.param("report_period", report_period, 2.0);
+
+  ros::Subscriber chunk_sub = node.subscribe("map_stream", 10, chunkCallback);
+  cloud_pub = node.advertise<sensor_msgs::PointCloud2>("map_stream/occupancy", 1);
+  report_time = ros::Time::now();
+  ros::Timer report_timer = node.createTimer(ros::Duration(report_period), reportCallback);
+
+  ros::spin();
+  return 0;
+}
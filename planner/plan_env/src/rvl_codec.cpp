@@ -0,0 +1,121 @@
+#include <cstring>
+#include <plan_env/rvl_codec.h>
+
+namespace {
+
+class NibbleWriter {
+public:
+  explicit NibbleWriter(std::vector<uint8_t>& out) : out_(out), word_(0), nibbles_(0) {
+  }
+
+  void put(int value) {
+    do {
+      int nibble = value & 0x7;
+      if (value >>= 3) nibble |= 0x8;
+      word_ = (word_ << 4) | nibble;
+      if (++nibbles_ == 8) flushWord();
+    } while (value);
+  }
+
+  void finish() {
+    if (nibbles_ == 0) return;
+    word_ <<= 4 * (8 - nibbles_);
+    flushWord();
+  }
+
+private:
+  std::vector<uint8_t>& out_;
+  uint32_t word_;
+  int nibbles_;
+
+  void flushWord() {
+    size_t n = out_.size();
+    out_.resize(n + 4);
+    memcpy(&out_[n], &word_, 4);
+    word_ = 0;
+    nibbles_ = 0;
+  }
+};
+
+class NibbleReader {
+public:
+  NibbleReader(const uint8_t* data, size_t size) : data_(data), end_(data + size), word_(0), nibbles_(0) {
+  }
+
+  bool get(int& value) {
+    uint32_t nibble;
+    value = 0;
+    int shift = 0;
+    do {
+      if (nibbles_ == 0) {
+        if (end_ - data_ < 4) return false;
+        memcpy(&word_, data_, 4);
+        data_ += 4;
+        nibbles_ = 8;
+      }
+      // no count or delta needs more than 30 bits, only a corrupt stream
+      if (shift > 27) return false;
+      nibble = word_ >> 28;
+      value |= (int)(nibble & 0x7) << shift;
+      word_ <<= 4;
+      --nibbles_;
+      shift += 3;
+    } while (nibble & 0x8);
+    return true;
+  }
+
+private:
+  const uint8_t* data_;
+  const uint8_t* end_;
+  uint32_t word_;
+  int nibbles_;
+};
+
+}  // namespace
+
+void encodeRvl(const uint16_t* depth, int num_pixels, std::vector<uint8_t>& out) {
+  NibbleWriter writer(out);
+  const uint16_t* end = depth + num_pixels;
+  int previous = 0;
+
+  while (depth != end) {
+    int zeros = 0, nonzeros = 0;
+    for (; depth != end && !*depth; ++depth) ++zeros;
+    writer.put(zeros);
+
+    for (const uint16_t* p = depth; p != end && *p; ++p) ++nonzeros;
+    writer.put(nonzeros);
+
+    for (int i = 0; i < nonzeros; ++i) {
+      int current = *depth++;
+      int delta = current - previous;
+      writer.put((delta * 2) ^ (delta >> 31));
+      previous = current;
+    }
+  }
+  writer.finish();
+}
+
+bool decodeRvl(const uint8_t* data, size_t size, uint16_t* depth, int num_pixels) {
+  NibbleReader reader(data, size);
+  int previous = 0;
+  int remaining = num_pixels;
+
+  while (remaining > 0) {
+    int zeros, nonzeros;
+    if (!reader.get(zeros) || zeros > remaining) return false;
+    memset(depth, 0, zeros * sizeof(uint16_t));
+    depth += zeros;
+    remaining -= zeros;
+
+    if (!reader.get(nonzeros) || nonzeros > remaining) return false;
+    remaining -= nonzeros;
+    for (; nonzeros; --nonzeros) {
+      int positive;
+      if (!reader.get(positive)) return false;
+      previous += (positive >> 1) ^ -(positive & 1);
+      *depth++ = (uint16_t)previous;
+    }
+  }
+  return true;
+}
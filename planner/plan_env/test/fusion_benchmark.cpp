@@ -0,0 +1,127 @@
+// Fusion time and cache misses with grid_map/sort_rays off and on, over the
+// same wall frames as the tests. Runs alternate between the two settings, so
+// drift of the machine hits both alike.
+//
+//   roslaunch plan_env fusion_benchmark.launch
+//
+// Cache misses are counted with perf over the benchmark thread and the map's
+// threads; they read n/a where the hardware counters are not exposed, as in
+// most virtual machines.
+
+#include "wall_frames.h"
+
+#include <cstring>
+#include <linux/perf_event.h>
+#include <plan_env/grid_map.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace wall_frames;
+
+namespace
+{
+// last level cache misses of the calling thread and of every thread it
+// starts while the counter is open
+class CacheMissCounter
+{
+public:
+  CacheMissCounter()
+  {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+  ~CacheMissCounter()
+  {
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  // counts of started threads are only added once they exit; -1 without
+  // hardware counters
+  long long misses() const
+  {
+    long long count;
+    if (fd_ < 0 || read(fd_, &count, sizeof(count)) != sizeof(count))
+      return -1;
+    return count;
+  }
+
+private:
+  int fd_;
+};
+
+struct FusionRun
+{
+  double mean_time, max_time;
+  long long misses;
+};
+
+FusionRun runFusion(bool sort_rays, int frames, double rate)
+{
+  ros::NodeHandle nh("~");
+  nh.setParam("grid_map/sort_rays", sort_rays);
+
+  FusionRun run;
+  CacheMissCounter counter;
+  {
+    GridMap map;
+    map.initMap(nh);
+
+    ros::Publisher depth_pub = nh.advertise<sensor_msgs::Image>("grid_map/depth", 50);
+    ros::Publisher pose_pub = nh.advertise<geometry_msgs::PoseStamped>("grid_map/pose", 50);
+    if (!waitForSubscribers(depth_pub, pose_pub, 10.0))
+      ROS_ERROR("The map did not subscribe to its inputs");
+
+    // slow enough for every frame to be fused on its own
+    ros::WallRate frame_rate(rate);
+    for (int f = 0; f < frames; ++f)
+    {
+      publishFrame(f, depth_pub, pose_pub);
+      ros::spinOnce();
+      frame_rate.sleep();
+    }
+    for (int i = 0; i < 50; ++i)
+    {
+      ros::spinOnce();
+      ros::WallDuration(0.01).sleep();
+    }
+    map.getFusionTime(run.mean_time, run.max_time);
+  }
+  // the map's threads have exited, so their misses are in
+  run.misses = counter.misses();
+  return run;
+}
+}  // namespace
+
+int main(int argc, char **argv)
+{
+  ros::init(argc, argv, "fusion_benchmark");
+  ros::NodeHandle private_node("~");
+
+  int frames, rounds;
+  double rate;
+  private_node.param("frames", frames, 300);
+  private_node.param("rounds", rounds, 3);
+  private_node.param("rate", rate, 15.0);
+
+  for (int r = 0; r < rounds && ros::ok(); ++r)
+    for (bool sort_rays : { false, true })
+    {
+      FusionRun run = runFusion(sort_rays, frames, rate);
+      char misses[32] = "n/a";
+      if (run.misses >= 0)
+        snprintf(misses, sizeof(misses), "%lld", run.misses / frames);
+      ROS_INFO("round %d, sort_rays %d: fusion mean %.3f ms, max %.3f ms, cache misses per frame %s", r, sort_rays,
+               run.mean_time * 1e3, run.max_time * 1e3, misses);
+    }
+  return 0;
+}
@@ -0,0 +1,53 @@
+// The fusion stages of a warmed-up map must not touch the heap. The test
+// feeds a static wall from a few alternating poses through the pipelined
+// stages, long past alloc_warmup_cycles, and expects the wall in the map and
+// no allocation counted after the warm-up. The target is built with
+// PLAN_ENV_COUNT_ALLOCS, see alloc_counter.h.
+
+#include "wall_frames.h"
+
+#include <gtest/gtest.h>
+#include <plan_env/alloc_counter.h>
+#include <plan_env/grid_map.h>
+
+using namespace wall_frames;
+
+TEST(GridMapAlloc, WarmStagesDoNotAllocate)
+{
+  ASSERT_TRUE(alloc_counter::enabled());
+
+  ros::NodeHandle nh("~");
+  GridMap map;
+  map.initMap(nh);
+
+  ros::Publisher depth_pub = nh.advertise<sensor_msgs::Image>("grid_map/depth", 50);
+  ros::Publisher pose_pub = nh.advertise<geometry_msgs::PoseStamped>("grid_map/pose", 50);
+  ASSERT_TRUE(waitForSubscribers(depth_pub, pose_pub, 10.0));
+
+  // every frame a cycle of its own, well past the 30 warm-up cycles
+  ros::WallRate rate(30.0);
+  for (int f = 0; f < 150; ++f)
+  {
+    publishFrame(f, depth_pub, pose_pub);
+    ros::spinOnce();
+    rate.sleep();
+  }
+
+  const Eigen::Vector3d wall(WALL_X + 0.05, 0.0, 1.0);
+  const ros::WallTime give_up = ros::WallTime::now() + ros::WallDuration(5.0);
+  while (map.getOccupancy(wall) != 1 && ros::WallTime::now() < give_up)
+  {
+    ros::spinOnce();
+    ros::WallDuration(0.01).sleep();
+  }
+
+  EXPECT_EQ(map.getOccupancy(wall), 1);
+  EXPECT_EQ(map.getWarmAllocations(), 0u);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  ros::init(argc, argv, "grid_map_alloc_test");
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,105 @@
+// grid_map/occupancy_stream end to end: the map of a static wall is streamed
+// to a MapChunkDecoder in the same node, which must end up with the inflated
+// map voxel for voxel, having taken far fewer bytes than the same map sent
+// as xyz points with every chunk.
+
+#include "wall_frames.h"
+
+#include <gtest/gtest.h>
+#include <plan_env/MapChunk.h>
+#include <plan_env/grid_map.h>
+#include <plan_env/map_codec.h>
+
+using namespace wall_frames;
+
+namespace
+{
+struct StreamReceiver
+{
+  map_codec::MapChunkDecoder decoder;
+  size_t chunk_bytes = 0, cloud_bytes = 0;
+  int chunk_num = 0, rejected_num = 0;
+
+  void chunkCallback(const plan_env::MapChunkConstPtr &chunk)
+  {
+    chunk_num++;
+    if (!decoder.apply(chunk->data.data(), chunk->data.size()))
+    {
+      rejected_num++;
+      return;
+    }
+    chunk_bytes += chunk->data.size();
+    for (char voxel : decoder.occupancy())
+      cloud_bytes += voxel ? 12 : 0;
+  }
+};
+
+// voxels where the decoded map and the inflated one differ
+int countMismatches(GridMap &map, const map_codec::MapChunkDecoder &decoder)
+{
+  const map_codec::MapChunkHeader &grid = decoder.header();
+  const std::vector<char> &occupancy = decoder.occupancy();
+  GridMap::VersionPin pin = map.pinVersion();
+
+  int mismatches = 0;
+  size_t adr = 0;
+  for (int x = 0; x < grid.size[0]; ++x)
+    for (int y = 0; y < grid.size[1]; ++y)
+      for (int z = 0; z < grid.size[2]; ++z, ++adr)
+      {
+        Eigen::Vector3d pos((x + 0.5) * grid.resolution + grid.origin[0], (y + 0.5) * grid.resolution + grid.origin[1],
+                            (z + 0.5) * grid.resolution + grid.origin[2]);
+        mismatches += map.getInflateOccupancy(pos) != int(occupancy[adr]);
+      }
+  return mismatches;
+}
+}  // namespace
+
+TEST(GridMapStream, DecodedMapMatchesInflated)
+{
+  ros::NodeHandle nh("~");
+  GridMap map;
+  map.initMap(nh);
+
+  StreamReceiver receiver;
+  ros::Subscriber chunk_sub =
+      nh.subscribe("grid_map/occupancy_stream", 100, &StreamReceiver::chunkCallback, &receiver);
+  ros::Publisher depth_pub = nh.advertise<sensor_msgs::Image>("grid_map/depth", 50);
+  ros::Publisher pose_pub = nh.advertise<geometry_msgs::PoseStamped>("grid_map/pose", 50);
+  ASSERT_TRUE(waitForSubscribers(depth_pub, pose_pub, 10.0));
+
+  // a few seconds of frames, so the stream sends keyframes and deltas both
+  ros::WallRate rate(30.0);
+  for (int f = 0; f < 150; ++f)
+  {
+    publishFrame(f, depth_pub, pose_pub);
+    ros::spinOnce();
+    rate.sleep();
+  }
+
+  // with no more frames the map settles, and the next chunks bring the
+  // decoder to its last version
+  int mismatches = -1;
+  const ros::WallTime give_up = ros::WallTime::now() + ros::WallDuration(10.0);
+  while (ros::WallTime::now() < give_up)
+  {
+    ros::WallDuration(0.3).sleep();
+    ros::spinOnce();
+    if (receiver.decoder.synced() && (mismatches = countMismatches(map, receiver.decoder)) == 0)
+      break;
+  }
+
+  EXPECT_GT(receiver.chunk_num, 1);
+  EXPECT_EQ(receiver.rejected_num, 0);
+  ASSERT_TRUE(receiver.decoder.synced());
+  EXPECT_EQ(mismatches, 0);
+  EXPECT_EQ(map.getInflateOccupancy(Eigen::Vector3d(WALL_X + 0.05, 0.0, 1.0)), 1);
+  EXPECT_LT(receiver.chunk_bytes * 10, receiver.cloud_bytes);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  ros::init(argc, argv, "grid_map_stream_test");
+  return RUN_ALL_TESTS();
+}
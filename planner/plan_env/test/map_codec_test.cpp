@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <cstring>
+#include <gtest/gtest.h>
+#include <plan_env/map_codec.h>
+#include <random>
+#include <set>
+
+using namespace map_codec;
+
+namespace
+{
+// an odd grid, so the last bricks along every axis are partial
+const int SIZE[3] = { 61, 43, 21 };
+
+int voxelNum(const int size[3])
+{
+  return size[0] * size[1] * size[2];
+}
+
+int address(const int size[3], int x, int y, int z)
+{
+  return (x * size[1] + y) * size[2] + z;
+}
+
+MapChunkHeader gridHeader(const int size[3])
+{
+  MapChunkHeader header;
+  header.version = 1;
+  header.base_version = 0;
+  header.keyframe = true;
+  for (int i = 0; i < 3; ++i)
+    header.size[i] = size[i];
+  header.resolution = 0.1;
+  header.origin[0] = -3.0;
+  header.origin[1] = -2.0;
+  header.origin[2] = -0.5;
+  return header;
+}
+
+// two walls and scattered noise, so every brick mode shows up
+std::vector<char> wallMap(std::mt19937 &rng)
+{
+  std::vector<char> map(voxelNum(SIZE), 0);
+  for (int x = 0; x < SIZE[0]; ++x)
+    for (int y = 0; y < SIZE[1]; ++y)
+      for (int z = 0; z < SIZE[2]; ++z)
+        if (x == 30 || y == 5 || rng() % 97 == 0)
+          map[address(SIZE, x, y, z)] = 1;
+  return map;
+}
+
+std::vector<int> occupiedBricks(const int size[3], const std::vector<char> &map)
+{
+  std::set<int> bricks;
+  for (int adr = 0; adr < (int)map.size(); ++adr)
+    if (map[adr])
+      bricks.insert(brickOf(size, adr));
+  return std::vector<int>(bricks.begin(), bricks.end());
+}
+
+// flip count random voxels, and return the sorted bricks they are in
+std::vector<int> flipVoxels(std::vector<char> &map, int count, std::mt19937 &rng)
+{
+  std::set<int> bricks;
+  for (int k = 0; k < count; ++k)
+  {
+    int adr = rng() % map.size();
+    map[adr] = !map[adr];
+    bricks.insert(brickOf(SIZE, adr));
+  }
+  return std::vector<int>(bricks.begin(), bricks.end());
+}
+}  // namespace
+
+TEST(MapCodec, BrickAddressing)
+{
+  int bricks[3];
+  brickGrid(SIZE, bricks);
+  EXPECT_EQ(bricks[0], 8);
+  EXPECT_EQ(bricks[1], 6);
+  EXPECT_EQ(bricks[2], 3);
+  EXPECT_EQ(brickCount(SIZE), 8 * 6 * 3);
+
+  EXPECT_EQ(brickOf(SIZE, address(SIZE, 0, 0, 0)), 0);
+  EXPECT_EQ(brickOf(SIZE, address(SIZE, 0, 0, 8)), 1);
+  EXPECT_EQ(brickOf(SIZE, address(SIZE, 0, 8, 0)), 3);
+  EXPECT_EQ(brickOf(SIZE, address(SIZE, 60, 42, 20)), brickCount(SIZE) - 1);
+}
+
+TEST(MapCodec, KeyframeRoundTrip)
+{
+  std::mt19937 rng(3);
+  std::vector<char> map = wallMap(rng);
+
+  MapChunkEncoder encoder;
+  MapChunkDecoder decoder;
+  std::vector<uint8_t> chunk;
+  MapChunkHeader header = gridHeader(SIZE);
+  encoder.encode(header, map.data(), occupiedBricks(SIZE, map), chunk);
+
+  ASSERT_TRUE(decoder.apply(chunk.data(), chunk.size()));
+  EXPECT_TRUE(decoder.synced());
+  EXPECT_EQ(decoder.occupancy(), map);
+  EXPECT_EQ(decoder.header().version, 1u);
+  EXPECT_TRUE(decoder.header().keyframe);
+  for (int i = 0; i < 3; ++i)
+  {
+    EXPECT_EQ(decoder.header().size[i], SIZE[i]);
+    EXPECT_DOUBLE_EQ(decoder.header().origin[i], header.origin[i]);
+  }
+  EXPECT_DOUBLE_EQ(decoder.header().resolution, 0.1);
+
+  // far below the 12 bytes an xyz point takes
+  const size_t occupied = std::count(map.begin(), map.end(), 1);
+  EXPECT_LT(chunk.size(), occupied * 12 / 10);
+}
+
+TEST(MapCodec, EmptyAndFullKeyframes)
+{
+  MapChunkEncoder encoder;
+  MapChunkDecoder decoder;
+  std::vector<uint8_t> chunk;
+  MapChunkHeader header = gridHeader(SIZE);
+
+  std::vector<char> map(voxelNum(SIZE), 0);
+  encoder.encode(header, map.data(), std::vector<int>(), chunk);
+  ASSERT_TRUE(decoder.apply(chunk.data(), chunk.size()));
+  EXPECT_EQ(decoder.occupancy(), map);
+
+  std::fill(map.begin(), map.end(), 1);
+  header.version = 2;
+  encoder.encode(header, map.data(), occupiedBricks(SIZE, map), chunk);
+  ASSERT_TRUE(decoder.apply(chunk.data(), chunk.size()));
+  EXPECT_EQ(decoder.occupancy(), map);
+}
+
+TEST(MapCodec, DeltaRoundTrip)
+{
+  std::mt19937 rng(5);
+  std::vector<char> map = wallMap(rng);
+
+  MapChunkEncoder encoder;
+  MapChunkDecoder decoder;
+  std::vector<uint8_t> chunk;
+  MapChunkHeader header = gridHeader(SIZE);
+  encoder.encode(header, map.data(), occupiedBricks(SIZE, map), chunk);
+  ASSERT_TRUE(decoder.apply(chunk.data(), chunk.size()));
+
+  header.keyframe = false;
+  for (int step = 0; step < 20; ++step)
+  {
+    std::vector<int> bricks = flipVoxels(map, 50, rng);
+    // a delta also clears whole bricks
+    if (step == 7)
+    {
+      std::set<int> cleared(bricks.begin(), bricks.end());
+      for (int adr = 0; adr < 8 * SIZE[1] * SIZE[2]; ++adr)
+        if (map[adr])
+        {
+          cleared.insert(brickOf(SIZE, adr));
+          map[adr] = 0;
+        }
+      bricks.assign(cleared.begin(), cleared.end());
+    }
+
+    header.base_version = header.version;
+    header.version++;
+    encoder.encode(header, map.data(), bricks, chunk);
+    ASSERT_TRUE(decoder.apply(chunk.data(), chunk.size())) << "delta " << step;
+    ASSERT_EQ(decoder.occupancy(), map) << "delta " << step;
+    EXPECT_EQ(decoder.header().version, header.version);
+  }
+}
+
+TEST(MapCodec, StaleDeltaRejected)
+{
+  std::mt19937 rng(7);
+  std::vector<char> map = wallMap(rng);
+
+  MapChunkEncoder encoder;
+  MapChunkDecoder decoder;
+  std::vector<uint8_t> chunk;
+  MapChunkHeader header = gridHeader(SIZE);
+
+  // nothing to apply a delta to before the first keyframe
+  header.keyframe = false;
+  header.version = 2;
+  header.base_version = 1;
+  encoder.encode(header, map.data(), flipVoxels(map, 10, rng), chunk);
+  EXPECT_FALSE(decoder.apply(chunk.data(), chunk.size()));
+  EXPECT_FALSE(decoder.synced());
+
+  header = gridHeader(SIZE);
+  header.version = 5;
+  encoder.encode(header, map.data(), occupiedBricks(SIZE, map), chunk);
+  ASSERT_TRUE(decoder.apply(chunk.data(), chunk.size()));
+
+  // a delta that skips a version leaves the held map as it was
+  const std::vector<char> held = decoder.occupancy();
+  std::vector<char> next = map;
+  header.keyframe = false;
+  header.base_version = 6;
+  header.version = 7;
+  encoder.encode(header, next.data(), flipVoxels(next, 10, rng), chunk);
+  EXPECT_FALSE(decoder.apply(chunk.data(), chunk.size()));
+  EXPECT_EQ(decoder.occupancy(), held);
+  EXPECT_EQ(decoder.header().version, 5u);
+
+  // as does one for a grid of another size
+  int other[3] = { SIZE[0], SIZE[1], SIZE[2] + 1 };
+  std::vector<char> other_map(voxelNum(other), 0);
+  header = gridHeader(other);
+  header.keyframe = false;
+  header.base_version = 5;
+  header.version = 6;
+  encoder.encode(header, other_map.data(), std::vector<int>(), chunk);
+  EXPECT_FALSE(decoder.apply(chunk.data(), chunk.size()));
+
+  // the delta that does follow still applies
+  next = map;
+  header = gridHeader(SIZE);
+  header.keyframe = false;
+  header.base_version = 5;
+  header.version = 6;
+  encoder.encode(header, next.data(), flipVoxels(next, 10, rng), chunk);
+  ASSERT_TRUE(decoder.apply(chunk.data(), chunk.size()));
+  EXPECT_EQ(decoder.occupancy(), next);
+}
+
+TEST(MapCodec, CorruptChunkRejected)
+{
+  std::mt19937 rng(11);
+  std::vector<char> map = wallMap(rng);
+
+  MapChunkEncoder encoder;
+  std::vector<uint8_t> chunk;
+  MapChunkHeader header = gridHeader(SIZE);
+  encoder.encode(header, map.data(), occupiedBricks(SIZE, map), chunk);
+
+  // shorter than a header
+  {
+    MapChunkDecoder decoder;
+    EXPECT_FALSE(decoder.apply(chunk.data(), 10));
+  }
+  // cut short in the payload
+  {
+    MapChunkDecoder decoder;
+    EXPECT_FALSE(decoder.apply(chunk.data(), chunk.size() - 8));
+    EXPECT_FALSE(decoder.synced());
+  }
+  // wrong magic
+  {
+    std::vector<uint8_t> bad = chunk;
+    bad[0] ^= 0xff;
+    MapChunkDecoder decoder;
+    EXPECT_FALSE(decoder.apply(bad.data(), bad.size()));
+  }
+  // a grid too large to allocate
+  {
+    std::vector<char> small(voxelNum(SIZE), 0);
+    MapChunkHeader huge = gridHeader(SIZE);
+    encoder.encode(huge, small.data(), std::vector<int>(), chunk);
+    int32_t side = 1 << 20;
+    for (int i = 0; i < 3; ++i)
+      memcpy(&chunk[24 + 4 * i], &side, 4);
+    MapChunkDecoder decoder;
+    EXPECT_FALSE(decoder.apply(chunk.data(), chunk.size()));
+  }
+
+  // random damage is rejected or decoded, but never read out of bounds
+  encoder.encode(header, map.data(), occupiedBricks(SIZE, map), chunk);
+  for (int k = 0; k < 2000; ++k)
+  {
+    std::vector<uint8_t> bad = chunk;
+    bad[rng() % bad.size()] ^= 1 << (rng() % 8);
+    if (rng() % 3 == 0)
+      bad.resize(rng() % bad.size());
+    MapChunkDecoder decoder;
+    if (decoder.apply(bad.data(), bad.size()))
+    {
+      EXPECT_EQ(decoder.occupancy().size(), size_t(voxelNum(decoder.header().size)));
+    }
+  }
+}
+
+// The sender side of GridMap::publishMapChunk against a receiver on a
+// lossless link: a map that fills in as a sensor sweeps through it, sent as
+// deltas of the changed bricks with periodic keyframes. The receiver stays
+// equal to the map, and the link carries a fraction of the bytes of
+// republishing the occupied voxels as xyz points every update.
+TEST(MapCodec, LoopbackStream)
+{
+  const int size[3] = { 200, 200, 40 };
+  std::vector<char> map(voxelNum(size), 0), sent(voxelNum(size), 0);
+  std::mt19937 rng(13);
+
+  MapChunkEncoder encoder;
+  MapChunkDecoder decoder;
+  std::vector<uint8_t> chunk;
+  MapChunkHeader header = gridHeader(size);
+  header.version = 0;
+
+  size_t stream_bytes = 0, cloud_bytes = 0;
+  int keyframes = 0;
+  for (int step = 0; step < 60; ++step)
+  {
+    // a slab of columns and scattered returns comes into view
+    const int x0 = 3 * step;
+    for (int x = x0; x < x0 + 3 && x < size[0]; ++x)
+      for (int y = 0; y < size[1]; ++y)
+        for (int z = 0; z < size[2]; ++z)
+          if ((y % 25 < 3 && z < 30) || rng() % 200 == 0)
+            map[address(size, x, y, z)] = 1;
+    // and some earlier returns turn out to be noise
+    for (int k = 0; k < 20; ++k)
+      map[rng() % map.size()] = 0;
+
+    std::set<int> changed;
+    for (int adr = 0; adr < (int)map.size(); ++adr)
+      if (map[adr] != sent[adr])
+      {
+        sent[adr] = map[adr];
+        changed.insert(brickOf(size, adr));
+      }
+
+    header.keyframe = step % 20 == 0;
+    header.base_version = header.keyframe ? 0 : header.version;
+    header.version++;
+    std::vector<int> bricks =
+        header.keyframe ? occupiedBricks(size, sent) : std::vector<int>(changed.begin(), changed.end());
+    encoder.encode(header, sent.data(), bricks, chunk);
+    keyframes += header.keyframe;
+
+    stream_bytes += chunk.size();
+    cloud_bytes += 12 * std::count(map.begin(), map.end(), 1);
+
+    ASSERT_TRUE(decoder.apply(chunk.data(), chunk.size())) << "step " << step;
+    ASSERT_EQ(decoder.occupancy(), map) << "step " << step;
+  }
+
+  EXPECT_EQ(keyframes, 3);
+  EXPECT_EQ(decoder.header().version, 60u);
+  EXPECT_LT(stream_bytes * 50, cloud_bytes) << stream_bytes << " bytes streamed, " << cloud_bytes << " as clouds";
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
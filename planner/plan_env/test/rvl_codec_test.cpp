@@ -0,0 +1,97 @@
+#include <cmath>
+#include <gtest/gtest.h>
+#include <plan_env/rvl_codec.h>
+#include <random>
+
+namespace
+{
+const int WIDTH = 640, HEIGHT = 480, PIXELS = WIDTH * HEIGHT;
+
+// a slanted surface with sensor noise, scattered holes, and no returns in
+// the bottom rows, like a depth camera looking at the floor
+std::vector<uint16_t> sceneDepth()
+{
+  std::mt19937 rng(1);
+  std::vector<uint16_t> depth(PIXELS);
+  for (int v = 0; v < HEIGHT; ++v)
+    for (int u = 0; u < WIDTH; ++u)
+    {
+      double z = 1500 + 800 * std::sin(u * 0.01) + v * 2 + rng() % 7;
+      depth[v * WIDTH + u] = (u * 7 + v * 13) % 97 < 5 || v > 440 ? 0 : uint16_t(z);
+    }
+  return depth;
+}
+
+std::vector<uint16_t> roundTrip(const std::vector<uint16_t> &depth, size_t *code_bytes = nullptr)
+{
+  std::vector<uint8_t> code;
+  encodeRvl(depth.data(), depth.size(), code);
+  if (code_bytes)
+    *code_bytes = code.size();
+
+  std::vector<uint16_t> decoded(depth.size(), 0xffff);
+  EXPECT_TRUE(decodeRvl(code.data(), code.size(), decoded.data(), decoded.size()));
+  return decoded;
+}
+}  // namespace
+
+TEST(RvlCodec, SceneRoundTrip)
+{
+  std::vector<uint16_t> depth = sceneDepth();
+  size_t code_bytes;
+  EXPECT_EQ(roundTrip(depth, &code_bytes), depth);
+  // smooth depth costs well under the raw 16 bits a pixel
+  EXPECT_LT(code_bytes * 2, depth.size() * sizeof(uint16_t));
+}
+
+TEST(RvlCodec, EmptyAndFullFrames)
+{
+  std::vector<uint16_t> empty(PIXELS, 0);
+  EXPECT_EQ(roundTrip(empty), empty);
+
+  std::vector<uint16_t> flat(PIXELS, 2000);
+  EXPECT_EQ(roundTrip(flat), flat);
+}
+
+TEST(RvlCodec, LargeDeltas)
+{
+  // the full 16-bit range between neighbours, both ways, and single pixel
+  // runs between holes
+  std::vector<uint16_t> depth(PIXELS);
+  for (int i = 0; i < PIXELS; ++i)
+    depth[i] = i % 3 == 2 ? 0 : i % 2 ? 0xffff : 1;
+  EXPECT_EQ(roundTrip(depth), depth);
+
+  std::mt19937 rng(2);
+  for (uint16_t &d : depth)
+    d = rng();
+  EXPECT_EQ(roundTrip(depth), depth);
+}
+
+TEST(RvlCodec, ShortDataRejected)
+{
+  std::vector<uint16_t> depth = sceneDepth(), decoded(PIXELS);
+  std::vector<uint8_t> code;
+  encodeRvl(depth.data(), PIXELS, code);
+
+  EXPECT_FALSE(decodeRvl(code.data(), 0, decoded.data(), PIXELS));
+  EXPECT_FALSE(decodeRvl(code.data(), code.size() / 2, decoded.data(), PIXELS));
+  EXPECT_FALSE(decodeRvl(code.data(), code.size() - 4, decoded.data(), PIXELS));
+}
+
+TEST(RvlCodec, TooFewPixelsRejected)
+{
+  std::vector<uint16_t> depth = sceneDepth(), decoded(PIXELS);
+  std::vector<uint8_t> code;
+  encodeRvl(depth.data(), PIXELS, code);
+
+  // the code runs past a smaller image, which must not be written beyond
+  decoded.resize(PIXELS / 2);
+  EXPECT_FALSE(decodeRvl(code.data(), code.size(), decoded.data(), PIXELS / 2));
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,81 @@
+#ifndef WALL_FRAMES_H_
+#define WALL_FRAMES_H_
+
+#include <Eigen/Eigen>
+#include <geometry_msgs/PoseStamped.h>
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/image_encodings.h>
+
+// Depth frames of a static scene for the GridMap tests: a wall at WALL_X
+// with a post in front of it, seen by a 640x480 camera at height 1 (fx 387,
+// cx 320, cy 240, as the .test files set) from a few alternating poses.
+namespace wall_frames
+{
+const int WIDTH = 640, HEIGHT = 480;
+const double WALL_X = 4.0;
+
+// depth of the scene from x, with no returns in the bottom rows
+inline sensor_msgs::ImagePtr wallImage(double x, const ros::Time &stamp)
+{
+  sensor_msgs::ImagePtr img(new sensor_msgs::Image);
+  img->header.stamp = stamp;
+  img->height = HEIGHT;
+  img->width = WIDTH;
+  img->encoding = sensor_msgs::image_encodings::TYPE_16UC1;
+  img->step = WIDTH * 2;
+  img->data.resize(img->step * HEIGHT);
+  uint16_t *depth = reinterpret_cast<uint16_t *>(img->data.data());
+  for (int v = 0; v < HEIGHT; ++v)
+    for (int u = 0; u < WIDTH; ++u)
+    {
+      double d = u >= 400 && u < 403 ? WALL_X - 1.5 - x : WALL_X - x;
+      depth[v * WIDTH + u] = v > 400 ? 0 : uint16_t(d * 1000);
+    }
+  return img;
+}
+
+// camera at (x, 0, 1) looking along x, turned by yaw
+inline geometry_msgs::PoseStampedPtr cameraPose(double x, double yaw, const ros::Time &stamp)
+{
+  Eigen::Matrix3d cam2w;
+  cam2w << 0, 0, 1, -1, 0, 0, 0, -1, 0;
+  Eigen::Quaterniond q(Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ()).toRotationMatrix() * cam2w);
+
+  geometry_msgs::PoseStampedPtr pose(new geometry_msgs::PoseStamped);
+  pose->header.stamp = stamp;
+  pose->pose.position.x = x;
+  pose->pose.position.y = 0.0;
+  pose->pose.position.z = 1.0;
+  pose->pose.orientation.w = q.w();
+  pose->pose.orientation.x = q.x();
+  pose->pose.orientation.y = q.y();
+  pose->pose.orientation.z = q.z();
+  return pose;
+}
+
+// frame f of the sequence, one of six poses
+inline void publishFrame(int f, ros::Publisher &depth_pub, ros::Publisher &pose_pub)
+{
+  const double x = 0.05 * (f % 6), yaw = 0.1 * (f % 6);
+  const ros::Time stamp = ros::Time::now();
+  depth_pub.publish(wallImage(x, stamp));
+  pose_pub.publish(cameraPose(x, yaw, stamp));
+}
+
+// spin until both topics reach the map, false after timeout seconds
+inline bool waitForSubscribers(const ros::Publisher &depth_pub, const ros::Publisher &pose_pub, double timeout)
+{
+  const ros::WallTime give_up = ros::WallTime::now() + ros::WallDuration(timeout);
+  while (depth_pub.getNumSubscribers() == 0 || pose_pub.getNumSubscribers() == 0)
+  {
+    if (ros::WallTime::now() > give_up)
+      return false;
+    ros::spinOnce();
+    ros::WallDuration(0.01).sleep();
+  }
+  return true;
+}
+}  // namespace wall_frames
+
+#endif  // WALL_FRAMES_H_